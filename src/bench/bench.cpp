@@ -0,0 +1,133 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "tinyformat.h"
+#include "univalue/univalue.h"
+#include "utiltime.h"
+
+#include <limits>
+
+#include <boost/foreach.hpp>
+
+namespace benchmark
+{
+static double GetTimeDouble()
+{
+    return GetTimeMicros() * 0.000001;
+}
+
+BenchRunner::BenchmarkMap& BenchRunner::Benchmarks()
+{
+    // constructed on first use, so registration order between files does not matter
+    static BenchmarkMap benchmarks;
+    return benchmarks;
+}
+
+BenchRunner::BenchRunner(const std::string& name, BenchFunction func)
+{
+    Benchmarks().insert(std::make_pair(name, func));
+}
+
+std::vector<std::string> BenchRunner::List()
+{
+    std::vector<std::string> vNames;
+    BOOST_FOREACH (const BenchmarkMap::value_type& p, Benchmarks())
+        vNames.push_back(p.first);
+    return vNames;
+}
+
+std::vector<Result> BenchRunner::RunAll(const std::string& strFilter, double dMaxElapsed)
+{
+    std::vector<Result> vResults;
+    BOOST_FOREACH (const BenchmarkMap::value_type& p, Benchmarks()) {
+        if (!strFilter.empty() && p.first.find(strFilter) == std::string::npos)
+            continue;
+        State state(p.first, dMaxElapsed);
+        p.second(state);
+        vResults.push_back(state.GetResult());
+    }
+    return vResults;
+}
+
+State::State(const std::string& nameIn, double dMaxElapsedIn) : name(nameIn), dMaxElapsed(dMaxElapsedIn), nCount(0), nTimeCheckCount(1)
+{
+    dBeginTime = dLastTime = 0;
+    dMinTime = std::numeric_limits<double>::max();
+    dMaxTime = 0;
+}
+
+bool State::KeepRunning()
+{
+    double dNow;
+    if (nCount == 0) {
+        dBeginTime = dNow = GetTimeDouble();
+    } else {
+        // Only look at the clock every nTimeCheckCount iterations, so that
+        // benchmarks of very fast code are not dominated by reading the time
+        if ((nCount + 1) % nTimeCheckCount != 0) {
+            ++nCount;
+            return true;
+        }
+        dNow = GetTimeDouble();
+        double dElapsedOne = (dNow - dLastTime) / nTimeCheckCount;
+        if (dElapsedOne < dMinTime) dMinTime = dElapsedOne;
+        if (dElapsedOne > dMaxTime) dMaxTime = dElapsedOne;
+        if (dElapsedOne * nTimeCheckCount < dMaxElapsed / 16) nTimeCheckCount *= 2;
+    }
+    dLastTime = dNow;
+    ++nCount;
+
+    if (dNow - dBeginTime < dMaxElapsed)
+        return true;
+
+    // the last call did not start an iteration
+    --nCount;
+    return false;
+}
+
+Result State::GetResult() const
+{
+    Result result;
+    result.name = name;
+    result.nIterations = nCount;
+    result.dMin = nCount ? dMinTime : 0;
+    result.dMax = dMaxTime;
+    result.dAverage = nCount ? (dLastTime - dBeginTime) / nCount : 0;
+    return result;
+}
+
+std::string FormatCSV(const std::vector<Result>& vResults)
+{
+    std::string strOut = "#Benchmark,count,min,max,average\n";
+    BOOST_FOREACH (const Result& result, vResults)
+        strOut += strprintf("%s,%d,%.9f,%.9f,%.9f\n", result.name, result.nIterations, result.dMin, result.dMax, result.dAverage);
+    return strOut;
+}
+
+std::string FormatJSON(const std::vector<Result>& vResults, const std::map<std::string, std::string>& mapContext)
+{
+    UniValue context(UniValue::VOBJ);
+    for (std::map<std::string, std::string>::const_iterator it = mapContext.begin(); it != mapContext.end(); ++it)
+        context.pushKV(it->first, it->second);
+
+    UniValue benchmarks(UniValue::VARR);
+    BOOST_FOREACH (const Result& result, vResults) {
+        UniValue entry(UniValue::VOBJ);
+        entry.pushKV("name", result.name);
+        entry.pushKV("count", result.nIterations);
+        entry.pushKV("min", result.dMin);
+        entry.pushKV("max", result.dMax);
+        entry.pushKV("average", result.dAverage);
+        benchmarks.push_back(entry);
+    }
+
+    UniValue doc(UniValue::VOBJ);
+    doc.pushKV("context", context);
+    doc.pushKV("benchmarks", benchmarks);
+    return doc.write(4) + "\n";
+}
+}
@@ -0,0 +1,91 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <boost/function.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/preprocessor/stringize.hpp>
+
+// Simple micro-benchmark framework; see bench_cc.cpp for the command line.
+//
+// Usage:
+//
+// static void CODE_TO_TIME(benchmark::State& state)
+// {
+//     ... do any setup needed...
+//     while (state.KeepRunning()) {
+//        ... do stuff you want to time...
+//     }
+//     ... do any cleanup needed...
+// }
+//
+// BENCHMARK(CODE_TO_TIME);
+
+namespace benchmark
+{
+/** Timing figures of one benchmark, in seconds per iteration */
+struct Result {
+    std::string name;
+    uint64_t nIterations;
+    double dMin;
+    double dMax;
+    double dAverage;
+};
+
+class State
+{
+    std::string name;
+    double dMaxElapsed;
+    double dBeginTime;
+    double dLastTime, dMinTime, dMaxTime;
+    uint64_t nCount;
+    uint64_t nTimeCheckCount;
+
+public:
+    State(const std::string& nameIn, double dMaxElapsedIn);
+
+    /** Returns true while the benchmark should do another iteration. */
+    bool KeepRunning();
+
+    Result GetResult() const;
+};
+
+typedef boost::function<void(State&)> BenchFunction;
+
+class BenchRunner
+{
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& Benchmarks();
+
+public:
+    BenchRunner(const std::string& name, BenchFunction func);
+
+    /** Names of all registered benchmarks, in the order they run. */
+    static std::vector<std::string> List();
+
+    /** Run every benchmark whose name contains strFilter for about dMaxElapsed seconds each. */
+    static std::vector<Result> RunAll(const std::string& strFilter, double dMaxElapsed);
+};
+
+/** Format results as CSV with a header row. */
+std::string FormatCSV(const std::vector<Result>& vResults);
+
+/** Format results as a JSON document, with free form key/value context first. */
+std::string FormatJSON(const std::vector<Result>& vResults, const std::map<std::string, std::string>& mapContext);
+}
+
+// BENCHMARK(foo) expands to:  benchmark::BenchRunner bench_11foo("foo", foo);
+#define BENCHMARK(n) \
+    benchmark::BenchRunner BOOST_PP_CAT(bench_, BOOST_PP_CAT(__LINE__, n))(BOOST_PP_STRINGIZE(n), n);
+
+#endif // BITCOIN_BENCH_BENCH_H
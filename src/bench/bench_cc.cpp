@@ -0,0 +1,81 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "crypto/scrypt.h"
+#include "crypto/sha256.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <boost/foreach.hpp>
+
+int main(int argc, char** argv)
+{
+    SetupEnvironment();
+    ParseParameters(argc, argv);
+
+    if (mapArgs.count("-?") || mapArgs.count("-help")) {
+        std::string strUsage = "CC benchmarks version " + FormatFullVersion() + "\n\n" +
+                               "Usage:  bench_cc [options]\n" +
+                               HelpMessageGroup("Options:") +
+                               HelpMessageOpt("-?", "This help message") +
+                               HelpMessageOpt("-filter=<text>", "Only run benchmarks whose name contains <text>") +
+                               HelpMessageOpt("-format=<format>", "Output format, csv or json (default: csv)") +
+                               HelpMessageOpt("-list", "List the benchmarks without running them") +
+                               HelpMessageOpt("-maxtime=<n>", "Run each benchmark for about <n> seconds (default: 1)") +
+                               HelpMessageOpt("-scrypt=<impl>", "scrypt implementation, auto or standard (default: auto)") +
+                               HelpMessageOpt("-sha256=<impl>", "SHA256 implementation, auto or standard (default: auto)");
+        fprintf(stdout, "%s", strUsage.c_str());
+        return 0;
+    }
+
+    if (GetBoolArg("-list", false)) {
+        BOOST_FOREACH (const std::string& name, benchmark::BenchRunner::List())
+            fprintf(stdout, "%s\n", name.c_str());
+        return 0;
+    }
+
+    std::string strFormat = GetArg("-format", "csv");
+    if (strFormat != "csv" && strFormat != "json") {
+        fprintf(stderr, "Error: Unknown output format '%s'\n", strFormat.c_str());
+        return 1;
+    }
+    double dMaxTime = atof(GetArg("-maxtime", "1").c_str());
+    if (dMaxTime <= 0) {
+        fprintf(stderr, "Error: -maxtime must be positive\n");
+        return 1;
+    }
+
+    // Without auto-detection the portable code stays in place, which makes
+    // the SHA256 and scrypt backends comparable by running the suite twice
+    std::string strSHA256 = "standard";
+    if (GetArg("-sha256", "auto") != "standard")
+        strSHA256 = SHA256AutoDetect();
+    std::string strScrypt = "standard";
+    if (GetArg("-scrypt", "auto") != "standard")
+        strScrypt = ScryptAutoDetect();
+
+    fPrintToDebugLog = false;
+    SelectParams(CBaseChainParams::MAIN);
+
+    std::vector<benchmark::Result> vResults = benchmark::BenchRunner::RunAll(GetArg("-filter", ""), dMaxTime);
+
+    if (strFormat == "json") {
+        std::map<std::string, std::string> mapContext;
+        mapContext["version"] = FormatFullVersion();
+        mapContext["sha256"] = strSHA256;
+        mapContext["scrypt"] = strScrypt;
+        mapContext["maxtime"] = strprintf("%g", dMaxTime);
+        fprintf(stdout, "%s", benchmark::FormatJSON(vResults, mapContext).c_str());
+    } else {
+        fprintf(stdout, "%s", benchmark::FormatCSV(vResults).c_str());
+    }
+    return 0;
+}
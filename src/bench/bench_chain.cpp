@@ -0,0 +1,63 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench_chain.h"
+
+#include "chain.h"
+#include "hash.h"
+#include "kernel.h"
+#include "main.h"
+#include "utiltime.h"
+
+#include <assert.h>
+
+CBenchChain::CBenchChain(int nBlocks, int nSpacing)
+{
+    LOCK(cs_main);
+    assert(chainActive.Tip() == NULL);
+
+    vBlocks.resize(nBlocks);
+    vpindex.reserve(nBlocks);
+    int64_t nTimeStart = GetTime() - (int64_t)nBlocks * nSpacing;
+    CBlockIndex* pindexPrev = NULL;
+    for (int i = 0; i < nBlocks; i++) {
+        CBlock& block = vBlocks[i];
+        block.hashPrevBlock = pindexPrev ? pindexPrev->GetBlockHash() : uint256();
+        block.hashMerkleRoot = Hash(BEGIN(i), END(i));
+        block.nTime = nTimeStart + (int64_t)i * nSpacing;
+        block.nBits = 0x1e0ffff0;
+        block.nNonce = i;
+
+        CBlockIndex* pindex = new CBlockIndex(block);
+        BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first;
+        pindex->phashBlock = &mi->first;
+        pindex->pprev = pindexPrev;
+        pindex->nHeight = i;
+        pindex->BuildSkip();
+        if (i >= 100)
+            pindex->SetProofOfStake();
+
+        uint64_t nStakeModifier = 0;
+        bool fGeneratedStakeModifier = false;
+        bool fModifier = ComputeNextStakeModifier(pindexPrev, nStakeModifier, fGeneratedStakeModifier);
+        assert(fModifier);
+        pindex->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+        pindex->SetStakeEntropyBit(pindex->GetStakeEntropyBit());
+
+        vpindex.push_back(pindex);
+        pindexPrev = pindex;
+    }
+    chainActive.SetTip(pindexPrev);
+}
+
+CBenchChain::~CBenchChain()
+{
+    LOCK(cs_main);
+    chainActive.SetTip(NULL);
+    ClearStakeModifierWindow();
+    for (size_t i = 0; i < vpindex.size(); i++) {
+        mapBlockIndex.erase(vpindex[i]->GetBlockHash());
+        delete vpindex[i];
+    }
+}
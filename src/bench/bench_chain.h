@@ -0,0 +1,31 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BENCH_BENCH_CHAIN_H
+#define BITCOIN_BENCH_BENCH_CHAIN_H
+
+#include "primitives/block.h"
+
+#include <vector>
+
+class CBlockIndex;
+
+/**
+ * An in-memory chain of block headers with stake modifiers, installed as
+ * chainActive and mapBlockIndex for as long as the object lives. Blocks are
+ * nSpacing seconds apart and proof-of-stake after the first hundred.
+ */
+class CBenchChain
+{
+public:
+    std::vector<CBlock> vBlocks; // headers only, no transactions
+    std::vector<CBlockIndex*> vpindex;
+
+    CBenchChain(int nBlocks, int nSpacing = 60);
+    ~CBenchChain();
+
+    CBlockIndex* Tip() const { return vpindex.back(); }
+};
+
+#endif // BITCOIN_BENCH_BENCH_CHAIN_H
@@ -0,0 +1,92 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+#include <assert.h>
+
+// A full looking block: a coinbase and 1999 transactions of two inputs and
+// two outputs each, with signature sized scriptSigs
+static CBlock BuildBenchBlock()
+{
+    CBlock block;
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0ffff0;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    block.vtx.push_back(coinbase);
+
+    for (int i = 1; i < 2000; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vin[j].prevout = COutPoint(GetRandHash(), insecure_rand() % 4);
+            std::vector<unsigned char> vch(107);
+            GetRandBytes(&vch[0], vch.size());
+            tx.vin[j].scriptSig = CScript(vch.begin(), vch.end());
+        }
+        tx.vout.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vout[j].nValue = insecure_rand() % (100 * COIN);
+            std::vector<unsigned char> vch(25);
+            GetRandBytes(&vch[0], vch.size());
+            tx.vout[j].scriptPubKey = CScript(vch.begin(), vch.end());
+        }
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void BuildMerkleTree2000(benchmark::State& state)
+{
+    const CBlock block = BuildBenchBlock();
+    while (state.KeepRunning()) {
+        uint256 hashMerkleRoot = block.BuildMerkleTree();
+        assert(hashMerkleRoot == block.hashMerkleRoot);
+    }
+}
+
+static void SerializeBlock(benchmark::State& state)
+{
+    const CBlock block = BuildBenchBlock();
+    while (state.KeepRunning()) {
+        CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+        stream << block;
+    }
+}
+
+// Includes hashing every transaction, which CTransaction does as it is read
+static void DeserializeBlock(benchmark::State& state)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << BuildBenchBlock();
+    const size_t nSize = stream.size();
+    // a trailing byte keeps the stream from clearing itself on reading the
+    // last byte of the block, which would make Rewind impossible
+    char a = '\0';
+    stream.write(&a, 1);
+
+    while (state.KeepRunning()) {
+        CBlock block;
+        stream >> block;
+        bool fRewound = stream.Rewind(nSize);
+        assert(fRewound);
+    }
+}
+
+BENCHMARK(BuildMerkleTree2000);
+BENCHMARK(SerializeBlock);
+BENCHMARK(DeserializeBlock);
@@ -0,0 +1,148 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "coins.h"
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "txdb.h"
+#include "utilstrencodings.h"
+
+#include <assert.h>
+
+static const int BENCH_COINS = 10000;
+static const int BENCH_COINS_TOUCHED = 1000;
+
+/** An in-memory coins view holding BENCH_COINS transactions of two outputs each */
+class CBenchCoinsView
+{
+public:
+    CCoinsView viewDummy;
+    CCoinsViewCache view;
+    std::vector<uint256> vTxid;
+
+    CBenchCoinsView() : view(&viewDummy)
+    {
+        CScript scriptPubKey;
+        scriptPubKey.resize(25); // pay-to-pubkey-hash size
+        for (int i = 0; i < BENCH_COINS; i++) {
+            uint256 txid = Hash(BEGIN(i), END(i));
+            CCoinsModifier coins = view.ModifyCoins(txid);
+            coins->vout.resize(2);
+            coins->vout[0].nValue = 50 * COIN;
+            coins->vout[0].scriptPubKey = scriptPubKey;
+            coins->vout[1].nValue = 1 * COIN;
+            coins->vout[1].scriptPubKey = scriptPubKey;
+            coins->nHeight = i;
+            coins->nVersion = 1;
+            vTxid.push_back(txid);
+        }
+    }
+
+    // Txids of BENCH_COINS_TOUCHED coins in random order
+    std::vector<uint256> Sample() const
+    {
+        std::vector<uint256> vSample;
+        for (int i = 0; i < BENCH_COINS_TOUCHED; i++)
+            vSample.push_back(vTxid[insecure_rand() % vTxid.size()]);
+        return vSample;
+    }
+};
+
+// Pulling coins into an empty cache on top of a populated one, as every
+// block connected against pcoinsTip does
+static void CCoinsViewCacheFetch(benchmark::State& state)
+{
+    CBenchCoinsView base;
+    const std::vector<uint256> vSample = base.Sample();
+
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&base.view);
+        for (size_t i = 0; i < vSample.size(); i++) {
+            const CCoins* coins = view.AccessCoins(vSample[i]);
+            assert(coins);
+        }
+    }
+}
+
+// Modifying coins in a child cache and writing them back to its parent
+static void CCoinsViewCacheFlush(benchmark::State& state)
+{
+    CBenchCoinsView base;
+    const std::vector<uint256> vSample = base.Sample();
+
+    int nHeight = BENCH_COINS;
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&base.view);
+        for (size_t i = 0; i < vSample.size(); i++) {
+            CCoinsModifier coins = view.ModifyCoins(vSample[i]);
+            coins->nHeight = nHeight;
+        }
+        bool fFlushed = view.Flush();
+        assert(fFlushed);
+        nHeight++;
+    }
+}
+
+/** An in-memory chainstate database holding the coins of CBenchCoinsView */
+class CBenchCoinsDB
+{
+public:
+    CCoinsViewDB db;
+    std::vector<CTransaction> vNewTx; // BENCH_COINS_TOUCHED transactions not in the database
+
+    CBenchCoinsDB() : db(1 << 20, true)
+    {
+        CBenchCoinsView coins;
+        CCoinsViewCache view(&db);
+        for (size_t i = 0; i < coins.vTxid.size(); i++)
+            *view.ModifyCoins(coins.vTxid[i]) = *coins.view.AccessCoins(coins.vTxid[i]);
+        view.SetBestBlock(coins.vTxid[0]);
+        bool fFlushed = view.Flush();
+        assert(fFlushed);
+
+        for (int i = 0; i < BENCH_COINS_TOUCHED; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(coins.vTxid[i], 0);
+            tx.vout.resize(2);
+            tx.vout[0].nValue = 49 * COIN;
+            tx.vout[1].nValue = 1 * COIN;
+            vNewTx.push_back(tx);
+        }
+    }
+};
+
+// Adding the outputs of new transactions the way UpdateCoins did before
+// ModifyNewCoins: every txid is looked up in the database first
+static void CCoinsViewDBAddLookup(benchmark::State& state)
+{
+    CBenchCoinsDB base;
+
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&base.db);
+        for (size_t i = 0; i < base.vNewTx.size(); i++)
+            view.ModifyCoins(base.vNewTx[i].GetHash())->FromTx(base.vNewTx[i], BENCH_COINS);
+    }
+}
+
+// The same through ModifyNewCoins, which skips the lookup
+static void CCoinsViewDBAddNew(benchmark::State& state)
+{
+    CBenchCoinsDB base;
+
+    while (state.KeepRunning()) {
+        CCoinsViewCache view(&base.db);
+        for (size_t i = 0; i < base.vNewTx.size(); i++)
+            view.ModifyNewCoins(base.vNewTx[i].GetHash())->FromTx(base.vNewTx[i], BENCH_COINS);
+    }
+}
+
+BENCHMARK(CCoinsViewCacheFetch);
+BENCHMARK(CCoinsViewCacheFlush);
+BENCHMARK(CCoinsViewDBAddLookup);
+BENCHMARK(CCoinsViewDBAddNew);
@@ -0,0 +1,102 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypto/scrypt.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+/* Number of bytes to hash per iteration */
+static const uint64_t BUFFER_SIZE = 1000 * 1000;
+
+static void SHA256_1M(benchmark::State& state)
+{
+    uint8_t hash[CSHA256::OUTPUT_SIZE];
+    std::vector<uint8_t> in(BUFFER_SIZE, 0);
+    while (state.KeepRunning())
+        CSHA256().Write(begin_ptr(in), in.size()).Finalize(hash);
+}
+
+static void SHA256_32b(benchmark::State& state)
+{
+    std::vector<uint8_t> in(32, 0);
+    while (state.KeepRunning())
+        CSHA256().Write(begin_ptr(in), in.size()).Finalize(begin_ptr(in));
+}
+
+// A merkle level of 1024 nodes hashed in one call, using as many lanes as the CPU has
+static void SHA256D64_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D64(begin_ptr(out), begin_ptr(in), 1024);
+}
+
+// The same level hashed one node at a time, as before the multi-lane code
+static void SHA256D64_1024_1way(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++)
+            SHA256D64(&out[32 * i], &in[64 * i], 1);
+    }
+}
+
+static void SHA256D80_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning())
+        SHA256D80(begin_ptr(out), begin_ptr(in), 1024);
+}
+
+// The proof of work of 64 block headers hashed in one call, using as many
+// scrypt lanes as the CPU has
+static void Scrypt_64Headers(benchmark::State& state)
+{
+    std::vector<char> in(80 * 64);
+    std::vector<char> out(32 * 64);
+    GetRandBytes((unsigned char*)begin_ptr(in), in.size());
+    while (state.KeepRunning())
+        scrypt_1024_1_1_256_batch(begin_ptr(in), begin_ptr(out), 64);
+}
+
+// The same headers hashed one at a time, as before the multi-lane code
+static void Scrypt_64Headers_1way(benchmark::State& state)
+{
+    std::vector<char> in(80 * 64);
+    std::vector<char> out(32 * 64);
+    GetRandBytes((unsigned char*)begin_ptr(in), in.size());
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 64; i++)
+            scrypt_1024_1_1_256(&in[80 * i], &out[32 * i]);
+    }
+}
+
+static void X11Hash9_80b(benchmark::State& state)
+{
+    std::vector<uint8_t> in(80, 0);
+    GetRandBytes(begin_ptr(in), in.size());
+    while (state.KeepRunning()) {
+        uint256 hash = Hash9(in.begin(), in.end());
+        memcpy(begin_ptr(in), hash.begin(), hash.size());
+    }
+}
+
+BENCHMARK(SHA256_1M);
+BENCHMARK(SHA256_32b);
+BENCHMARK(SHA256D64_1024);
+BENCHMARK(SHA256D64_1024_1way);
+BENCHMARK(SHA256D80_1024);
+BENCHMARK(Scrypt_64Headers);
+BENCHMARK(Scrypt_64Headers_1way);
+BENCHMARK(X11Hash9_80b);
@@ -0,0 +1,70 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_chain.h"
+
+#include "chain.h"
+#include "hash.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "timedata.h"
+
+#include <assert.h>
+
+static const int BENCH_MASTERNODES = 1000;
+
+// Fill mnodeman with enabled masternodes that are old enough to be ranked
+static void AddBenchMasternodes(CMasternodeMan& mnodeman, std::vector<CTxIn>& vVin)
+{
+    int64_t nNow = GetAdjustedTime();
+    for (int i = 0; i < BENCH_MASTERNODES; i++) {
+        CMasternode mn;
+        mn.vin = CTxIn(COutPoint(Hash(BEGIN(i), END(i)), 0));
+        mn.sigTime = nNow - 24 * 60 * 60;
+        mn.lastPing.vin = mn.vin;
+        mn.lastPing.sigTime = nNow;
+        bool fAdded = mnodeman.Add(mn);
+        assert(fAdded);
+        vVin.push_back(mn.vin);
+    }
+}
+
+// Rank lookups at one height, answered from the cached rank table
+static void GetMasternodeRankCached(benchmark::State& state)
+{
+    CBenchChain chain(500);
+    CMasternodeMan mnodeman;
+    std::vector<CTxIn> vVin;
+    AddBenchMasternodes(mnodeman, vVin);
+
+    const int nHeight = chain.Tip()->nHeight;
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        int nRank = mnodeman.GetMasternodeRank(vVin[i++ % vVin.size()], nHeight, 0, false);
+        assert(nRank > 0);
+    }
+}
+
+// Rank lookups cycling through more heights than there are cached tables,
+// so that each one scores and sorts the whole list
+static void GetMasternodeRankRebuild(benchmark::State& state)
+{
+    CBenchChain chain(500);
+    CMasternodeMan mnodeman;
+    std::vector<CTxIn> vVin;
+    AddBenchMasternodes(mnodeman, vVin);
+
+    const int nHeights = 2 * MASTERNODE_RANK_TABLES;
+    const int nHeightFirst = chain.Tip()->nHeight - nHeights;
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        int nRank = mnodeman.GetMasternodeRank(vVin[i % vVin.size()], nHeightFirst + i % nHeights, 0, false);
+        assert(nRank > 0);
+        i++;
+    }
+}
+
+BENCHMARK(GetMasternodeRankCached);
+BENCHMARK(GetMasternodeRankRebuild);
@@ -0,0 +1,91 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "bench_chain.h"
+
+#include "amount.h"
+#include "chain.h"
+#include "kernel.h"
+#include "main.h"
+#include "primitives/transaction.h"
+
+#include <assert.h>
+
+// Baseline: one full legacy CheckStakeKernelHash scan over a 60 second
+// drift, the way the minter used to call it for every candidate coin
+static void CheckStakeKernelHashScan(benchmark::State& state)
+{
+    CBenchChain chain(2000);
+
+    // a coin from far enough back that its kernel stake modifier exists
+    const CBlock& blockFrom = chain.vBlocks[1000];
+    CMutableTransaction mtx;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000 * COIN;
+    const CTransaction txPrev(mtx);
+    const COutPoint prevout(txPrev.GetHash(), 0);
+
+    // hard enough that the scan practically never finds a kernel and stops early
+    const unsigned int nBits = 0x1a00ffff;
+    const unsigned int nTimeStart = chain.Tip()->nTime;
+
+    while (state.KeepRunning()) {
+        unsigned int nTimeTx = nTimeStart;
+        uint256 hashProofOfStake;
+        CheckStakeKernelHash(nBits, blockFrom, txPrev, prevout, nTimeTx, 60, false, hashProofOfStake);
+    }
+}
+
+// The same scan through CStakeKernelSearch, which the minter uses now: the
+// candidate is added and prepared once, so only the hashing is timed
+static void StakeKernelSearchScan(benchmark::State& state)
+{
+    CBenchChain chain(2000);
+
+    CMutableTransaction mtx;
+    mtx.vout.resize(1);
+    mtx.vout[0].nValue = 1000 * COIN;
+    const CTransaction txPrev(mtx);
+
+    const unsigned int nBits = 0x1a00ffff;
+    const unsigned int nTimeStart = chain.Tip()->nTime;
+
+    CStakeKernelSearch search;
+    search.Add(COutPoint(txPrev.GetHash(), 0), txPrev.vout[0].nValue, chain.vpindex[1000]);
+    {
+        LOCK(cs_main);
+        search.Prepare(nBits);
+    }
+
+    while (state.KeepRunning()) {
+        size_t nIndex = 0;
+        unsigned int nTimeTx = 0;
+        uint256 hashProofOfStake;
+        search.Search(nTimeStart, 60, nIndex, nTimeTx, hashProofOfStake);
+    }
+}
+
+// Computing the modifier of the next block, from the incremental candidate window
+static void ComputeNextStakeModifierTip(benchmark::State& state)
+{
+    CBenchChain chain(2000);
+
+    // Pretend the tip did not generate a modifier yet, otherwise the call
+    // returns early with the modifier of the current interval
+    CBlockIndex* pindexTip = chain.Tip();
+    pindexTip->nFlags &= ~CBlockIndex::BLOCK_STAKE_MODIFIER;
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        uint64_t nStakeModifier = 0;
+        bool fGeneratedStakeModifier = false;
+        bool fModifier = ComputeNextStakeModifier(pindexTip, nStakeModifier, fGeneratedStakeModifier);
+        assert(fModifier && fGeneratedStakeModifier);
+    }
+}
+
+BENCHMARK(CheckStakeKernelHashScan);
+BENCHMARK(StakeKernelSearchScan);
+BENCHMARK(ComputeNextStakeModifierTip);
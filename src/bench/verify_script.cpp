@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "primitives/transaction.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+#include "script/standard.h"
+
+#include <assert.h>
+
+// A transaction spending a pay-to-pubkey-hash output, signed by key
+static CMutableTransaction BuildSpend(const CKey& key, const CScript& scriptPubKey, int nInputs)
+{
+    CMutableTransaction txCredit;
+    txCredit.vout.resize(1);
+    txCredit.vout[0].nValue = 1;
+    txCredit.vout[0].scriptPubKey = scriptPubKey;
+
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(nInputs);
+    for (int i = 0; i < nInputs; i++)
+        txSpend.vin[i].prevout = COutPoint(txCredit.GetHash(), i);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 1;
+    txSpend.vout[0].scriptPubKey = scriptPubKey;
+
+    for (int i = 0; i < nInputs; i++) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, txSpend, i, SIGHASH_ALL);
+        bool fSigned = key.Sign(hash, vchSig);
+        assert(fSigned);
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        txSpend.vin[i].scriptSig = CScript() << vchSig << ToByteVector(key.GetPubKey());
+    }
+    return txSpend;
+}
+
+// Signature hashes of every input of a 100 input transaction
+static void SignatureHashAllInputs(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const CTransaction tx(BuildSpend(key, scriptPubKey, 100));
+
+    while (state.KeepRunning()) {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            SignatureHash(scriptPubKey, tx, i, SIGHASH_ALL);
+    }
+}
+
+// Full script evaluation of one signed input, signature check included
+static void VerifyScriptP2PKH(benchmark::State& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const CTransaction tx(BuildSpend(key, scriptPubKey, 1));
+    const unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS;
+
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool fValid = VerifyScript(tx.vin[0].scriptSig, scriptPubKey, flags, TransactionSignatureChecker(&tx, 0), &err);
+        assert(fValid && err == SCRIPT_ERR_OK);
+    }
+}
+
+BENCHMARK(SignatureHashAllInputs);
+BENCHMARK(VerifyScriptP2PKH);
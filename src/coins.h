@@ -7,6 +7,8 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "core_memusage.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -289,6 +291,15 @@ public:
     {
         return strprintf("CCoin (Version %d, Height %d)", nVersion, nHeight);
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            ret += RecursiveDynamicUsage(out.scriptPubKey);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -313,13 +324,31 @@ public:
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    int nBaseHeight; // Height of the parent view's version; a transaction added again under the same txid differs in nothing else.
+    std::vector<bool> vBaseAvail; // Outputs the parent view has, recorded when a non-FRESH entry is first made DIRTY.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nBaseHeight(0) {}
+
+    //! Remember which outputs the parent view has, before the entry is modified for the first time
+    void RecordBase()
+    {
+        if (flags & (DIRTY | FRESH))
+            return;
+        nBaseHeight = coins.nHeight;
+        vBaseAvail.resize(coins.vout.size());
+        for (unsigned int n = 0; n < coins.vout.size(); n++)
+            vBaseAvail[n] = coins.IsAvailable(n);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return coins.DynamicMemoryUsage() + memusage::MallocUsage((vBaseAvail.capacity() + 7) / 8);
+    }
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
@@ -358,6 +387,10 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats& stats) const;
 
+    //! Wait until everything passed to BatchWrite is on disk; false if it
+    //! could not be written
+    virtual bool Sync() const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -377,6 +410,7 @@ public:
     void SetBackend(CCoinsView& viewIn);
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    bool Sync() const;
 };
 
 class CCoinsViewCache;
@@ -404,7 +438,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -427,6 +462,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
@@ -452,6 +490,13 @@ public:
      */
     CCoinsModifier ModifyCoins(const uint256& txid);
 
+    /**
+     * Like ModifyCoins, for the outputs of a transaction that is being added
+     * and that spends inputs, so no unspent version of it can exist. The
+     * parent view is not consulted and the entry is emptied.
+     */
+    CCoinsModifier ModifyNewCoins(const uint256& txid);
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
@@ -462,6 +507,9 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes)
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of cc coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
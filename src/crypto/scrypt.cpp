@@ -27,6 +27,10 @@
  * online backup system.
  */
 
+#if defined(HAVE_CONFIG_H)
+#include "config/cc-config.h"
+#endif
+
 #include "crypto/scrypt.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
@@ -36,6 +40,15 @@
 #include <string.h>
 #include <stdint.h>
 
+// The multi-lane kernels are x86 only and not part of libbitcoinconsensus.
+// SSE2 is part of x86-64, so the 4-way kernel needs no extra compiler flags.
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && !defined(BUILD_BITCOIN_INTERNAL) && \
+    defined(__SSE2__)
+#define USE_SCRYPT_LANES 1
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
 #ifndef __FreeBSD__
 static inline void be32enc(void *pp, uint32_t x)
 {
@@ -537,3 +550,210 @@ void scrypt_1024_1_1_256(const char *input, char *output)
         scrypt_1024_1_1_256_sp_generic(input, output, scratchpad);
 #endif
 }
+
+/**
+ * Multi-lane scrypt_1024_1_1_256: the ROMix of several independent inputs is
+ * computed with one SIMD vector holding the same word of every input, which
+ * hides the latency of the salsa20/8 rounds and of the random reads from V.
+ * PBKDF2 is a small part of the cost and stays one input at a time.
+ */
+
+#if defined(USE_SCRYPT_LANES)
+#if defined(ENABLE_AVX2)
+namespace scrypt_avx2
+{
+void ROMix_8way(unsigned char* B, uint32_t* V);
+}
+#endif
+
+namespace
+{
+namespace scrypt_sse2
+{
+// One vector holds word i of 4 independent blocks
+typedef __m128i vec;
+const int LANES = 4;
+
+vec inline Add(vec x, vec y) { return _mm_add_epi32(x, y); }
+vec inline Xor(vec x, vec y) { return _mm_xor_si128(x, y); }
+vec inline RotL(vec x, int n) { return _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - n)); }
+
+/** xor_salsa8 above, on every lane at once */
+void inline XorSalsa8(vec* B, const vec* Bx)
+{
+    vec x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        x[ 4] = Xor(x[ 4], RotL(Add(x[ 0], x[12]),  7));  x[ 9] = Xor(x[ 9], RotL(Add(x[ 5], x[ 1]),  7));
+        x[14] = Xor(x[14], RotL(Add(x[10], x[ 6]),  7));  x[ 3] = Xor(x[ 3], RotL(Add(x[15], x[11]),  7));
+
+        x[ 8] = Xor(x[ 8], RotL(Add(x[ 4], x[ 0]),  9));  x[13] = Xor(x[13], RotL(Add(x[ 9], x[ 5]),  9));
+        x[ 2] = Xor(x[ 2], RotL(Add(x[14], x[10]),  9));  x[ 7] = Xor(x[ 7], RotL(Add(x[ 3], x[15]),  9));
+
+        x[12] = Xor(x[12], RotL(Add(x[ 8], x[ 4]), 13));  x[ 1] = Xor(x[ 1], RotL(Add(x[13], x[ 9]), 13));
+        x[ 6] = Xor(x[ 6], RotL(Add(x[ 2], x[14]), 13));  x[11] = Xor(x[11], RotL(Add(x[ 7], x[ 3]), 13));
+
+        x[ 0] = Xor(x[ 0], RotL(Add(x[12], x[ 8]), 18));  x[ 5] = Xor(x[ 5], RotL(Add(x[ 1], x[13]), 18));
+        x[10] = Xor(x[10], RotL(Add(x[ 6], x[ 2]), 18));  x[15] = Xor(x[15], RotL(Add(x[11], x[ 7]), 18));
+
+        /* Operate on rows. */
+        x[ 1] = Xor(x[ 1], RotL(Add(x[ 0], x[ 3]),  7));  x[ 6] = Xor(x[ 6], RotL(Add(x[ 5], x[ 4]),  7));
+        x[11] = Xor(x[11], RotL(Add(x[10], x[ 9]),  7));  x[12] = Xor(x[12], RotL(Add(x[15], x[14]),  7));
+
+        x[ 2] = Xor(x[ 2], RotL(Add(x[ 1], x[ 0]),  9));  x[ 7] = Xor(x[ 7], RotL(Add(x[ 6], x[ 5]),  9));
+        x[ 8] = Xor(x[ 8], RotL(Add(x[11], x[10]),  9));  x[13] = Xor(x[13], RotL(Add(x[12], x[15]),  9));
+
+        x[ 3] = Xor(x[ 3], RotL(Add(x[ 2], x[ 1]), 13));  x[ 4] = Xor(x[ 4], RotL(Add(x[ 7], x[ 6]), 13));
+        x[ 9] = Xor(x[ 9], RotL(Add(x[ 8], x[11]), 13));  x[14] = Xor(x[14], RotL(Add(x[13], x[12]), 13));
+
+        x[ 0] = Xor(x[ 0], RotL(Add(x[ 3], x[ 2]), 18));  x[ 5] = Xor(x[ 5], RotL(Add(x[ 4], x[ 7]), 18));
+        x[10] = Xor(x[10], RotL(Add(x[ 9], x[ 8]), 18));  x[15] = Xor(x[15], RotL(Add(x[14], x[13]), 18));
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] = Add(B[i], x[i]);
+}
+
+/**
+ * The two loops of scrypt_1024_1_1_256_sp_generic on 4 adjacent 128-byte
+ * blocks B, in place. V must hold 1024 * 32 * 4 words and be 16-byte aligned.
+ */
+void ROMix_4way(unsigned char* B, uint32_t* V)
+{
+    vec X[32];
+    for (int k = 0; k < 32; k++)
+        X[k] = _mm_setr_epi32(le32dec(B + 4 * k), le32dec(B + 128 + 4 * k),
+            le32dec(B + 256 + 4 * k), le32dec(B + 384 + 4 * k));
+
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++)
+            _mm_store_si128((vec*)&V[LANES * (32 * i + k)], X[k]);
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+    for (int i = 0; i < 1024; i++) {
+        // Each lane reads its own entry of V
+        uint32_t j[LANES];
+        _mm_storeu_si128((vec*)j, X[16]);
+        for (int l = 0; l < LANES; l++)
+            j[l] = LANES * 32 * (j[l] & 1023) + l;
+        for (int k = 0; k < 32; k++)
+            X[k] = Xor(X[k], _mm_setr_epi32(V[j[0] + LANES * k], V[j[1] + LANES * k],
+                                 V[j[2] + LANES * k], V[j[3] + LANES * k]));
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    for (int k = 0; k < 32; k++) {
+        uint32_t lanes[LANES];
+        _mm_storeu_si128((vec*)lanes, X[k]);
+        for (int l = 0; l < LANES; l++)
+            le32enc(B + 128 * l + 4 * k, lanes[l]);
+    }
+}
+} // namespace scrypt_sse2
+
+void inline GetCPUID(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+}
+
+/** Check that the OS saves the AVX registers on context switches. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+} // namespace
+#endif
+
+namespace
+{
+typedef void (*ROMixLanesType)(unsigned char*, uint32_t*);
+
+// Kernels picked by ScryptAutoDetect, none until then
+ROMixLanesType ROMix_4way = NULL;
+ROMixLanesType ROMix_8way = NULL;
+
+/** scrypt_1024_1_1_256 of nLanes adjacent inputs using romix; V as for the kernel */
+void ScryptLanes(ROMixLanesType romix, int nLanes, const char* input, char* output, uint32_t* V)
+{
+    unsigned char B[128 * 8];
+    for (int l = 0; l < nLanes; l++)
+        PBKDF2_SHA256((const uint8_t*)input + 80 * l, 80, (const uint8_t*)input + 80 * l, 80, 1, B + 128 * l, 128);
+    romix(B, V);
+    for (int l = 0; l < nLanes; l++)
+        PBKDF2_SHA256((const uint8_t*)input + 80 * l, 80, B + 128 * l, 128, 1, (uint8_t*)output + 32 * l, 32);
+}
+
+/** Compare whatever kernels are selected with the portable code. */
+bool SelfTest()
+{
+    // 12 inputs go through the 8-way and the 4-way kernel when both are selected
+    char in[80 * 12];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (char)(i * 151 + 7);
+
+    char exp[32 * 12], out[32 * 12];
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    for (int i = 0; i < 12; i++)
+        scrypt_1024_1_1_256_sp_generic(in + 80 * i, exp + 32 * i, scratchpad);
+    scrypt_1024_1_1_256_batch(in, out, 12);
+    return memcmp(out, exp, sizeof(out)) == 0;
+}
+} // namespace
+
+std::string ScryptAutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_SCRYPT_LANES)
+    ROMix_4way = scrypt_sse2::ROMix_4way;
+    ret += ",sse2(4way)";
+
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(0, 0, eax, ebx, ecx, edx);
+    uint32_t nMaxLeaf = eax;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabled();
+    bool fAVX2 = false;
+    if (nMaxLeaf >= 7) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        fAVX2 = fAVX && ((ebx >> 5) & 1);
+    }
+    (void)fAVX2;
+
+#if defined(ENABLE_AVX2)
+    if (fAVX2) {
+        ROMix_8way = scrypt_avx2::ROMix_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+#endif
+
+    if (!SelfTest()) {
+        ROMix_4way = ROMix_8way = NULL;
+        ret = "standard (self-test of " + ret + " failed)";
+    }
+    return ret;
+}
+
+void scrypt_1024_1_1_256_batch(const char* input, char* output, size_t n)
+{
+    // One scratchpad for the widest kernel that gets used, 128 KiB per lane;
+    // without it everything takes the single input path below
+    void* V0 = NULL;
+    if ((ROMix_8way && n >= 8) || (ROMix_4way && n >= 4))
+        V0 = malloc(128 * 1024 * 8 + 63);
+    uint32_t* V = (uint32_t*)(((uintptr_t)(V0) + 63) & ~(uintptr_t)(63));
+
+    for (; V0 && ROMix_8way && n >= 8; n -= 8, input += 80 * 8, output += 32 * 8)
+        ScryptLanes(ROMix_8way, 8, input, output, V);
+    for (; V0 && ROMix_4way && n >= 4; n -= 4, input += 80 * 4, output += 32 * 4)
+        ScryptLanes(ROMix_4way, 4, input, output, V);
+    for (; n > 0; n--, input += 80, output += 32)
+        scrypt_1024_1_1_256(input, output);
+
+    free(V0);
+}
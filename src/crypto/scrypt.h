@@ -11,6 +11,16 @@ static const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 void scrypt_1024_1_1_256(const char *input, char *output);
 void scrypt_1024_1_1_256_sp_generic(const char *input, char *output, char *scratchpad);
 
+/** Autodetect the multi-lane scrypt kernels this CPU supports, check them
+ *  against the portable code and return a description of what is used.
+ */
+std::string ScryptAutoDetect();
+
+/** Compute scrypt_1024_1_1_256 of n independent 80-byte inputs, writing
+ *  32 bytes per input to output. Used to hash many block headers at once.
+ */
+void scrypt_1024_1_1_256_batch(const char *input, char *output, size_t n);
+
 #if defined(USE_SSE2)
 extern void scrypt_detect_sse2(unsigned int cpuid_edx);
 void scrypt_1024_1_1_256_sp_sse2(const char *input, char *output, char *scratchpad);
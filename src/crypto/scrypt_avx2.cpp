@@ -0,0 +1,121 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Eight-lane scrypt ROMix using AVX2, built with -mavx -mavx2 and only called
+// after ScryptAutoDetect has seen CPU and OS support for it.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/cc-config.h"
+#endif
+
+#if defined(ENABLE_AVX2) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+
+#include "crypto/common.h"
+
+#include <immintrin.h>
+#include <stdint.h>
+
+namespace scrypt_avx2
+{
+namespace
+{
+// One vector holds word i of 8 independent blocks
+typedef __m256i vec;
+const int LANES = 8;
+
+vec inline K(uint32_t x) { return _mm256_set1_epi32(x); }
+vec inline Add(vec x, vec y) { return _mm256_add_epi32(x, y); }
+vec inline Xor(vec x, vec y) { return _mm256_xor_si256(x, y); }
+vec inline And(vec x, vec y) { return _mm256_and_si256(x, y); }
+vec inline ShL(vec x, int n) { return _mm256_slli_epi32(x, n); }
+vec inline RotL(vec x, int n) { return _mm256_or_si256(ShL(x, n), _mm256_srli_epi32(x, 32 - n)); }
+
+void inline XorSalsa8(vec* B, const vec* Bx)
+{
+    vec x[16];
+    for (int i = 0; i < 16; i++)
+        x[i] = B[i] = Xor(B[i], Bx[i]);
+    for (int i = 0; i < 8; i += 2) {
+        /* Operate on columns. */
+        x[ 4] = Xor(x[ 4], RotL(Add(x[ 0], x[12]),  7));  x[ 9] = Xor(x[ 9], RotL(Add(x[ 5], x[ 1]),  7));
+        x[14] = Xor(x[14], RotL(Add(x[10], x[ 6]),  7));  x[ 3] = Xor(x[ 3], RotL(Add(x[15], x[11]),  7));
+
+        x[ 8] = Xor(x[ 8], RotL(Add(x[ 4], x[ 0]),  9));  x[13] = Xor(x[13], RotL(Add(x[ 9], x[ 5]),  9));
+        x[ 2] = Xor(x[ 2], RotL(Add(x[14], x[10]),  9));  x[ 7] = Xor(x[ 7], RotL(Add(x[ 3], x[15]),  9));
+
+        x[12] = Xor(x[12], RotL(Add(x[ 8], x[ 4]), 13));  x[ 1] = Xor(x[ 1], RotL(Add(x[13], x[ 9]), 13));
+        x[ 6] = Xor(x[ 6], RotL(Add(x[ 2], x[14]), 13));  x[11] = Xor(x[11], RotL(Add(x[ 7], x[ 3]), 13));
+
+        x[ 0] = Xor(x[ 0], RotL(Add(x[12], x[ 8]), 18));  x[ 5] = Xor(x[ 5], RotL(Add(x[ 1], x[13]), 18));
+        x[10] = Xor(x[10], RotL(Add(x[ 6], x[ 2]), 18));  x[15] = Xor(x[15], RotL(Add(x[11], x[ 7]), 18));
+
+        /* Operate on rows. */
+        x[ 1] = Xor(x[ 1], RotL(Add(x[ 0], x[ 3]),  7));  x[ 6] = Xor(x[ 6], RotL(Add(x[ 5], x[ 4]),  7));
+        x[11] = Xor(x[11], RotL(Add(x[10], x[ 9]),  7));  x[12] = Xor(x[12], RotL(Add(x[15], x[14]),  7));
+
+        x[ 2] = Xor(x[ 2], RotL(Add(x[ 1], x[ 0]),  9));  x[ 7] = Xor(x[ 7], RotL(Add(x[ 6], x[ 5]),  9));
+        x[ 8] = Xor(x[ 8], RotL(Add(x[11], x[10]),  9));  x[13] = Xor(x[13], RotL(Add(x[12], x[15]),  9));
+
+        x[ 3] = Xor(x[ 3], RotL(Add(x[ 2], x[ 1]), 13));  x[ 4] = Xor(x[ 4], RotL(Add(x[ 7], x[ 6]), 13));
+        x[ 9] = Xor(x[ 9], RotL(Add(x[ 8], x[11]), 13));  x[14] = Xor(x[14], RotL(Add(x[13], x[12]), 13));
+
+        x[ 0] = Xor(x[ 0], RotL(Add(x[ 3], x[ 2]), 18));  x[ 5] = Xor(x[ 5], RotL(Add(x[ 4], x[ 7]), 18));
+        x[10] = Xor(x[10], RotL(Add(x[ 9], x[ 8]), 18));  x[15] = Xor(x[15], RotL(Add(x[14], x[13]), 18));
+    }
+    for (int i = 0; i < 16; i++)
+        B[i] = Add(B[i], x[i]);
+}
+
+/** Load little endian word i of each lane, the lanes being 128 bytes apart. */
+vec inline Read(const unsigned char* in, int i)
+{
+    return _mm256_setr_epi32(ReadLE32(in + 4 * i), ReadLE32(in + 128 + 4 * i),
+        ReadLE32(in + 256 + 4 * i), ReadLE32(in + 384 + 4 * i),
+        ReadLE32(in + 512 + 4 * i), ReadLE32(in + 640 + 4 * i),
+        ReadLE32(in + 768 + 4 * i), ReadLE32(in + 896 + 4 * i));
+}
+
+/** Store word i of each lane back into its 128-byte block. */
+void inline Write(unsigned char* out, int i, vec x)
+{
+    uint32_t lanes[LANES];
+    _mm256_storeu_si256((vec*)lanes, x);
+    for (int l = 0; l < LANES; l++)
+        WriteLE32(out + 128 * l + 4 * i, lanes[l]);
+}
+} // namespace
+
+/**
+ * The two loops of scrypt_1024_1_1_256_sp_generic on 8 adjacent 128-byte
+ * blocks B, in place. V must hold 1024 * 32 * 8 words and be 32-byte aligned.
+ */
+void ROMix_8way(unsigned char* B, uint32_t* V)
+{
+    vec X[32];
+    for (int k = 0; k < 32; k++)
+        X[k] = Read(B, k);
+
+    for (int i = 0; i < 1024; i++) {
+        for (int k = 0; k < 32; k++)
+            _mm256_store_si256((vec*)&V[LANES * (32 * i + k)], X[k]);
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    // Word k of lane l of entry j sits at index LANES * (32 * j + k) + l of V
+    const vec lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int i = 0; i < 1024; i++) {
+        vec j = Add(ShL(And(X[16], K(1023)), 8), lanes);
+        for (int k = 0; k < 32; k++)
+            X[k] = Xor(X[k], _mm256_i32gather_epi32((const int*)V, Add(j, K(LANES * k)), 4));
+        XorSalsa8(&X[0], &X[16]);
+        XorSalsa8(&X[16], &X[0]);
+    }
+
+    for (int k = 0; k < 32; k++)
+        Write(B, k, X[k]);
+}
+} // namespace scrypt_avx2
+
+#endif
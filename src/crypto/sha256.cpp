@@ -2,12 +2,23 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/cc-config.h"
+#endif
+
 #include "crypto/sha256.h"
 
 #include "crypto/common.h"
 
 #include <string.h>
 
+// The multi-lane and SHA-NI backends are x86 only and not part of libbitcoinconsensus
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && !defined(BUILD_BITCOIN_INTERNAL) && \
+    (defined(ENABLE_SSE41) || defined(ENABLE_AVX2) || defined(ENABLE_SHANI))
+#define USE_SHA256_LANES 1
+#include <cpuid.h>
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -44,7 +55,7 @@ void inline Initialize(uint32_t* s)
 }
 
 /** Perform one SHA-256 transformation, processing a 64-byte chunk. */
-void Transform(uint32_t* s, const unsigned char* chunk)
+void TransformBlock(uint32_t* s, const unsigned char* chunk)
 {
     uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
     uint32_t w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
@@ -127,8 +138,216 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Perform a number of SHA-256 transformations, processing 64-byte chunks. */
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    while (blocks--) {
+        TransformBlock(s, chunk);
+        chunk += 64;
+    }
+}
+
 } // namespace sha256
+
+typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
+typedef void (*TransformLanesType)(unsigned char*, const unsigned char*);
+
+// Backends picked by SHA256AutoDetect, the portable code until then
+TransformType Transform = sha256::Transform;
+TransformLanesType TransformD64_4way = NULL;
+TransformLanesType TransformD80_4way = NULL;
+TransformLanesType TransformD64_8way = NULL;
+TransformLanesType TransformD80_8way = NULL;
+
+// A 64-byte message is followed by a whole padding block, an 80-byte message
+// (a block header) shares its second block with the padding and the 32-byte
+// intermediate hash of the double hash fits in a single block with its padding.
+const unsigned char PAD64[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00};
+
+/** Finish a double hash: hash the 32-byte state s once more into out. */
+void inline FinalizeD(unsigned char* out, const uint32_t* s)
+{
+    unsigned char buf[64] = {0};
+    for (int j = 0; j < 8; j++)
+        WriteBE32(buf + 4 * j, s[j]);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+
+    uint32_t s2[8];
+    sha256::Initialize(s2);
+    Transform(s2, buf, 1);
+    for (int j = 0; j < 8; j++)
+        WriteBE32(out + 4 * j, s2[j]);
+}
+
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    uint32_t s[8];
+    sha256::Initialize(s);
+    Transform(s, in, 1);
+    Transform(s, PAD64, 1);
+    FinalizeD(out, s);
+}
+
+void TransformD80(unsigned char* out, const unsigned char* in)
+{
+    unsigned char buf[64] = {0};
+    memcpy(buf, in + 64, 16);
+    buf[16] = 0x80;
+    buf[62] = 0x02;
+    buf[63] = 0x80;
+
+    uint32_t s[8];
+    sha256::Initialize(s);
+    Transform(s, in, 1);
+    Transform(s, buf, 1);
+    FinalizeD(out, s);
+}
+
+} // namespace
+
+#if defined(USE_SHA256_LANES)
+#if defined(ENABLE_SSE41)
+namespace sha256_sse41
+{
+void TransformD64_4way(unsigned char* out, const unsigned char* in);
+void TransformD80_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#if defined(ENABLE_AVX2)
+namespace sha256_avx2
+{
+void TransformD64_8way(unsigned char* out, const unsigned char* in);
+void TransformD80_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#if defined(ENABLE_SHANI)
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
+}
+#endif
+
+namespace
+{
+void inline GetCPUID(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+}
+
+/** Check that the OS saves the AVX registers on context switches. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
 } // namespace
+#endif
+
+namespace
+{
+/** Compare whatever backends are selected with the portable code. */
+bool SelfTest()
+{
+    unsigned char in[80 * 8];
+    for (size_t i = 0; i < sizeof(in); i++)
+        in[i] = (unsigned char)(i * 151 + 7);
+
+    // Expected values from the portable code
+    unsigned char exp64[32 * 8], exp80[32 * 8];
+    TransformType transform = Transform;
+    Transform = sha256::Transform;
+    for (int i = 0; i < 8; i++) {
+        TransformD64(exp64 + 32 * i, in + 64 * i);
+        TransformD80(exp80 + 32 * i, in + 80 * i);
+    }
+    uint32_t exps[8];
+    sha256::Initialize(exps);
+    Transform(exps, in, 10);
+    Transform = transform;
+
+    unsigned char out[32 * 8];
+    uint32_t s[8];
+    sha256::Initialize(s);
+    Transform(s, in, 10);
+    if (memcmp(s, exps, sizeof(s)))
+        return false;
+    for (int i = 0; i < 8; i++) {
+        TransformD64(out + 32 * i, in + 64 * i);
+        if (memcmp(out + 32 * i, exp64 + 32 * i, 32))
+            return false;
+    }
+    if (TransformD64_4way) {
+        TransformD64_4way(out, in);
+        TransformD80_4way(out + 128, in);
+        if (memcmp(out, exp64, 128) || memcmp(out + 128, exp80, 128))
+            return false;
+    }
+    if (TransformD64_8way) {
+        TransformD64_8way(out, in);
+        if (memcmp(out, exp64, 256))
+            return false;
+        TransformD80_8way(out, in);
+        if (memcmp(out, exp80, 256))
+            return false;
+    }
+    return true;
+}
+} // namespace
+
+std::string SHA256AutoDetect()
+{
+    std::string ret = "standard";
+#if defined(USE_SHA256_LANES)
+    uint32_t eax, ebx, ecx, edx;
+    GetCPUID(0, 0, eax, ebx, ecx, edx);
+    uint32_t nMaxLeaf = eax;
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    bool fSSE41 = (ecx >> 19) & 1;
+    bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabled();
+    bool fAVX2 = false, fSHANI = false;
+    if (nMaxLeaf >= 7) {
+        GetCPUID(7, 0, eax, ebx, ecx, edx);
+        fAVX2 = fAVX && ((ebx >> 5) & 1);
+        fSHANI = (ebx >> 29) & 1;
+    }
+    (void)fSSE41;
+    (void)fAVX2;
+    (void)fSHANI;
+
+#if defined(ENABLE_SHANI)
+    if (fSHANI && fSSE41) {
+        Transform = sha256_shani::Transform;
+        ret = "shani(1way)";
+    }
+#endif
+#if defined(ENABLE_SSE41)
+    if (fSSE41) {
+        TransformD64_4way = sha256_sse41::TransformD64_4way;
+        TransformD80_4way = sha256_sse41::TransformD80_4way;
+        ret += ",sse41(4way)";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    if (fAVX2) {
+        TransformD64_8way = sha256_avx2::TransformD64_8way;
+        TransformD80_8way = sha256_avx2::TransformD80_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+#endif
+
+    if (!SelfTest()) {
+        Transform = sha256::Transform;
+        TransformD64_4way = TransformD80_4way = NULL;
+        TransformD64_8way = TransformD80_8way = NULL;
+        ret = "standard (self-test of " + ret + " failed)";
+    }
+    return ret;
+}
 
 
 ////// SHA-256
@@ -147,14 +366,15 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf, 1);
         bufsize = 0;
     }
-    while (end >= data + 64) {
+    if (end - data >= 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
-        bytes += 64;
-        data += 64;
+        size_t blocks = (end - data) / 64;
+        Transform(s, data, blocks);
+        bytes += 64 * blocks;
+        data += 64 * blocks;
     }
     if (end > data) {
         // Fill the buffer with what remains.
@@ -187,3 +407,55 @@ CSHA256& CSHA256::Reset()
     sha256::Initialize(s);
     return *this;
 }
+
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    if (TransformD64_8way) {
+        while (blocks >= 8) {
+            TransformD64_8way(output, input);
+            output += 256;
+            input += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (blocks >= 4) {
+            TransformD64_4way(output, input);
+            output += 128;
+            input += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD64(output, input);
+        output += 32;
+        input += 64;
+        --blocks;
+    }
+}
+
+void SHA256D80(unsigned char* output, const unsigned char* input, size_t blocks)
+{
+    if (TransformD80_8way) {
+        while (blocks >= 8) {
+            TransformD80_8way(output, input);
+            output += 256;
+            input += 640;
+            blocks -= 8;
+        }
+    }
+    if (TransformD80_4way) {
+        while (blocks >= 4) {
+            TransformD80_4way(output, input);
+            output += 128;
+            input += 320;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD80(output, input);
+        output += 32;
+        input += 80;
+        --blocks;
+    }
+}
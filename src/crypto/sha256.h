@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,4 +26,19 @@ public:
     CSHA256& Reset();
 };
 
+/** Autodetect the best available SHA256 implementation, check it against the
+ *  portable code and return a description of what is used.
+ */
+std::string SHA256AutoDetect();
+
+/** Compute the double-SHA256 of blocks independent 64-byte inputs, writing
+ *  32 bytes per input to output. Used to hash merkle tree nodes.
+ */
+void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute the double-SHA256 of blocks independent 80-byte inputs, writing
+ *  32 bytes per input to output. Used to hash block headers.
+ */
+void SHA256D80(unsigned char* output, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -0,0 +1,166 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+//
+// Four-lane SHA-256 using SSE4.1, built with -msse4.1 and only called after
+// SHA256AutoDetect has seen CPU support for it.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/cc-config.h"
+#endif
+
+#if defined(ENABLE_SSE41) && (defined(__x86_64__) || defined(__amd64__) || defined(__i386__))
+
+#include "crypto/common.h"
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+
+namespace sha256_sse41
+{
+namespace
+{
+const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+const uint32_t INIT[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+
+// One vector holds word i of 4 independent messages
+typedef __m128i vec;
+const int LANES = 4;
+
+vec inline K(uint32_t x) { return _mm_set1_epi32(x); }
+vec inline Add(vec x, vec y) { return _mm_add_epi32(x, y); }
+vec inline Add(vec x, vec y, vec z) { return Add(Add(x, y), z); }
+vec inline Add(vec x, vec y, vec z, vec w) { return Add(Add(x, y), Add(z, w)); }
+vec inline Xor(vec x, vec y) { return _mm_xor_si128(x, y); }
+vec inline Xor(vec x, vec y, vec z) { return Xor(Xor(x, y), z); }
+vec inline Or(vec x, vec y) { return _mm_or_si128(x, y); }
+vec inline And(vec x, vec y) { return _mm_and_si128(x, y); }
+vec inline ShR(vec x, int n) { return _mm_srli_epi32(x, n); }
+vec inline ShL(vec x, int n) { return _mm_slli_epi32(x, n); }
+vec inline Rot(vec x, int n) { return Or(ShR(x, n), ShL(x, 32 - n)); }
+
+vec inline Ch(vec x, vec y, vec z) { return Xor(z, And(x, Xor(y, z))); }
+vec inline Maj(vec x, vec y, vec z) { return Or(And(x, y), And(z, Or(x, y))); }
+vec inline Sigma0(vec x) { return Xor(Rot(x, 2), Rot(x, 13), Rot(x, 22)); }
+vec inline Sigma1(vec x) { return Xor(Rot(x, 6), Rot(x, 11), Rot(x, 25)); }
+vec inline sigma0(vec x) { return Xor(Rot(x, 7), Rot(x, 18), ShR(x, 3)); }
+vec inline sigma1(vec x) { return Xor(Rot(x, 17), Rot(x, 19), ShR(x, 10)); }
+
+/** Load big endian word i of each lane, the lanes being stride bytes apart. */
+vec inline Read(const unsigned char* in, int stride, int i)
+{
+    return _mm_setr_epi32(ReadBE32(in + 4 * i), ReadBE32(in + 1 * stride + 4 * i),
+        ReadBE32(in + 2 * stride + 4 * i), ReadBE32(in + 3 * stride + 4 * i));
+}
+
+/** Store the state of each lane as a 32-byte hash, the outputs being adjacent. */
+void inline Write(unsigned char* out, const vec* s)
+{
+    uint32_t lanes[LANES];
+    for (int i = 0; i < 8; i++) {
+        _mm_storeu_si128((vec*)lanes, s[i]);
+        for (int l = 0; l < LANES; l++)
+            WriteBE32(out + 32 * l + 4 * i, lanes[l]);
+    }
+}
+
+void inline Initialize(vec* s)
+{
+    for (int i = 0; i < 8; i++)
+        s[i] = K(INIT[i]);
+}
+
+/** One SHA-256 compression of a 16-word block per lane. Consumes w. */
+void Compress(vec* s, vec* w)
+{
+    vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = 0; i < 64; i++) {
+        if (i >= 16)
+            w[i & 15] = Add(w[i & 15], sigma1(w[(i + 14) & 15]), w[(i + 9) & 15], sigma0(w[(i + 1) & 15]));
+        vec t1 = Add(Add(h, Sigma1(e), Ch(e, f, g)), K(K256[i]), w[i & 15]);
+        vec t2 = Add(Sigma0(a), Maj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = Add(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = Add(t1, t2);
+    }
+    s[0] = Add(s[0], a);
+    s[1] = Add(s[1], b);
+    s[2] = Add(s[2], c);
+    s[3] = Add(s[3], d);
+    s[4] = Add(s[4], e);
+    s[5] = Add(s[5], f);
+    s[6] = Add(s[6], g);
+    s[7] = Add(s[7], h);
+}
+
+/** Hash the 32-byte first pass state s again and write the results. */
+void FinalizeD(unsigned char* out, vec* s)
+{
+    vec w[16];
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = K(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = K(0);
+    w[15] = K(0x100);
+    Initialize(s);
+    Compress(s, w);
+    Write(out, s);
+}
+} // namespace
+
+void TransformD64_4way(unsigned char* out, const unsigned char* in)
+{
+    vec s[8], w[16];
+    Initialize(s);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read(in, 64, i);
+    Compress(s, w);
+
+    // padding block of a 64-byte message
+    w[0] = K(0x80000000);
+    for (int i = 1; i < 15; i++)
+        w[i] = K(0);
+    w[15] = K(0x200);
+    Compress(s, w);
+
+    FinalizeD(out, s);
+}
+
+void TransformD80_4way(unsigned char* out, const unsigned char* in)
+{
+    vec s[8], w[16];
+    Initialize(s);
+    for (int i = 0; i < 16; i++)
+        w[i] = Read(in, 80, i);
+    Compress(s, w);
+
+    // last 16 bytes of an 80-byte message and its padding
+    for (int i = 0; i < 4; i++)
+        w[i] = Read(in + 64, 80, i);
+    w[4] = K(0x80000000);
+    for (int i = 5; i < 15; i++)
+        w[i] = K(0);
+    w[15] = K(0x280);
+    Compress(s, w);
+
+    FinalizeD(out, s);
+}
+} // namespace sha256_sse41
+
+#endif
@@ -3,8 +3,14 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <algorithm>
+#include <deque>
+#include <functional>
+
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include "db.h"
 #include "kernel.h"
@@ -21,6 +27,7 @@ bool fTestNet = false; //Params().NetworkID() == CBaseChainParams::TESTNET;
 // Set to 3-hour for production network and 20-minute for test network
 unsigned int nModifierInterval;
 int nStakeTargetSpacing = 300;
+int nStakeThreads = DEFAULT_STAKE_THREADS;
 unsigned int getIntervalVersion(bool fTestNet)
 {
     if (fTestNet)
@@ -71,67 +78,179 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
-// select a block from the candidate blocks in vSortedByTimestamp, excluding
-// already selected blocks in vSelectedBlocks, and with timestamp up to
-// nSelectionIntervalStop.
-static bool SelectBlockFromCandidates(
-    vector<pair<int64_t, uint256> >& vSortedByTimestamp,
-    map<uint256, const CBlockIndex*>& mapSelectedBlocks,
-    int64_t nSelectionIntervalStop,
-    uint64_t nStakeModifierPrev,
-    const CBlockIndex** pindexSelected)
-{
-    bool fModifierV2 = false;
-    bool fFirstRun = true;
-    bool fSelected = false;
-    uint256 hashBest = 0;
-    *pindexSelected = (const CBlockIndex*)0;
-    BOOST_FOREACH (const PAIRTYPE(int64_t, uint256) & item, vSortedByTimestamp) {
-        if (!mapBlockIndex.count(item.second))
-            return error("SelectBlockFromCandidates: failed to find block index for candidate block %s", item.second.ToString().c_str());
-
-        const CBlockIndex* pindex = mapBlockIndex[item.second];
-        if (fSelected && pindex->GetBlockTime() > nSelectionIntervalStop)
-            break;
-
-        //if the lowest block height (vSortedByTimestamp[0]) is >= switch height, use new modifier calc
-        if (fFirstRun){
-            fModifierV2 = pindex->nHeight >= Params().ModifierUpgradeBlock();
-            fFirstRun = false;
-        }
+namespace
+{
+/**
+ * Candidate blocks for the next stake modifier. The chain-ordered window is
+ * kept across calls and moved along with pindexPrev (extended as the tip
+ * advances, rewound on disconnect), and the buffers are reused, so computing
+ * a modifier does not walk pprev or allocate. Selection hashes only depend on
+ * the previous modifier and are computed once per candidate; each of the 64
+ * rounds then pops the best eligible candidate from a heap. Protected by
+ * cs_main, like the rest of the block index.
+ */
+class CStakeModifierWindow
+{
+public:
+    struct Candidate {
+        int64_t nTime;
+        uint256 hashBlock;
+        const CBlockIndex* pindex;
+        bool operator<(const Candidate& b) const { return nTime < b.nTime || (nTime == b.nTime && hashBlock < b.hashBlock); }
+    };
 
-        if (mapSelectedBlocks.count(pindex->GetBlockHash()) > 0)
-            continue;
+    // Set vCandidates to the window of pindexPrev sorted by timestamp and
+    // return the height of the first candidate
+    int Load(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart);
+
+    // Run the 64 selection rounds, filling vSelected
+    bool Select(int64_t nSelectionIntervalStart, uint64_t nStakeModifierPrev, uint64_t& nStakeModifierNew);
+
+    void Clear();
+
+    std::vector<Candidate> vCandidates;
+    std::vector<const CBlockIndex*> vSelected;
+
+private:
+    void MoveTo(const CBlockIndex* pindexPrev);
+
+    std::deque<const CBlockIndex*> dequeChain; // contiguous ancestors ending at the last pindexPrev
+    std::vector<const CBlockIndex*> vPending;
+    std::vector<std::pair<uint256, size_t> > vHeap;
+};
 
-        // compute the selection hash by hashing an input that is unique to that block
-        uint256 hashProof;
-        if(fModifierV2)
-            hashProof = pindex->GetBlockHash();
-        else
-            hashProof = pindex->IsProofOfStake() ? 0 : pindex->GetBlockHash();
-
-        CDataStream ss(SER_GETHASH, 0);
-        ss << hashProof << nStakeModifierPrev;
-        uint256 hashSelection = Hash(ss.begin(), ss.end());
-
-        // the selection hash is divided by 2**32 so that proof-of-stake block
-        // is always favored over proof-of-work block. this is to preserve
-        // the energy efficiency property
-        if (pindex->IsProofOfStake())
-            hashSelection >>= 32;
-
-        if (fSelected && hashSelection < hashBest) {
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*)pindex;
-        } else if (!fSelected) {
-            fSelected = true;
-            hashBest = hashSelection;
-            *pindexSelected = (const CBlockIndex*)pindex;
+void CStakeModifierWindow::Clear()
+{
+    vCandidates.clear();
+    vSelected.clear();
+    dequeChain.clear();
+    vPending.clear();
+    vHeap.clear();
+}
+
+void CStakeModifierWindow::MoveTo(const CBlockIndex* pindexPrev)
+{
+    // Walk back until reaching a block that is already in the window
+    vPending.clear();
+    const CBlockIndex* pindex = pindexPrev;
+    while (pindex && !dequeChain.empty() && pindex->nHeight > dequeChain.back()->nHeight) {
+        vPending.push_back(pindex);
+        pindex = pindex->pprev;
+    }
+    if (!pindex || dequeChain.empty() || pindex->nHeight < dequeChain.front()->nHeight ||
+        dequeChain[pindex->nHeight - dequeChain.front()->nHeight] != pindex) {
+        // unrelated to the current window: start over
+        dequeChain.clear();
+        dequeChain.push_back(pindexPrev);
+        return;
+    }
+
+    // Rewind to the common block, then append the new blocks
+    while (dequeChain.back() != pindex)
+        dequeChain.pop_back();
+    for (std::vector<const CBlockIndex*>::reverse_iterator it = vPending.rbegin(); it != vPending.rend(); ++it)
+        dequeChain.push_back(*it);
+}
+
+int CStakeModifierWindow::Load(const CBlockIndex* pindexPrev, int64_t nSelectionIntervalStart)
+{
+    MoveTo(pindexPrev);
+
+    // The window is the run of blocks back from pindexPrev with a timestamp
+    // of at least nSelectionIntervalStart; keep the block that ends it.
+    size_t nEnd = dequeChain.size();
+    while (nEnd > 0 && dequeChain[nEnd - 1]->GetBlockTime() >= nSelectionIntervalStart)
+        nEnd--;
+    while (nEnd == 0 && dequeChain.front()->pprev) {
+        dequeChain.push_front(dequeChain.front()->pprev);
+        if (dequeChain.front()->GetBlockTime() < nSelectionIntervalStart)
+            nEnd = 1;
+    }
+    size_t nFirst = nEnd;
+    if (nFirst > 1)
+        dequeChain.erase(dequeChain.begin(), dequeChain.begin() + (nFirst - 1));
+    if (nFirst > 0)
+        nFirst = 1;
+
+    vCandidates.clear();
+    for (size_t i = nFirst; i < dequeChain.size(); i++) {
+        Candidate candidate;
+        candidate.nTime = dequeChain[i]->GetBlockTime();
+        candidate.hashBlock = dequeChain[i]->GetBlockHash();
+        candidate.pindex = dequeChain[i];
+        vCandidates.push_back(candidate);
+    }
+    // nearly sorted already, as timestamps mostly increase along the chain
+    std::sort(vCandidates.begin(), vCandidates.end());
+
+    return nFirst < dequeChain.size() ? dequeChain[nFirst]->nHeight : pindexPrev->nHeight + 1;
+}
+
+bool CStakeModifierWindow::Select(int64_t nSelectionIntervalStart, uint64_t nStakeModifierPrev, uint64_t& nStakeModifierNew)
+{
+    nStakeModifierNew = 0;
+    vSelected.clear();
+    vHeap.clear();
+    if (vCandidates.empty())
+        return true;
+
+    //if the lowest block height (vSortedByTimestamp[0]) is >= switch height, use new modifier calc
+    bool fModifierV2 = vCandidates[0].pindex->nHeight >= Params().ModifierUpgradeBlock();
+
+    // heap ordered by (selection hash, position): the earliest candidate wins ties
+    std::greater<std::pair<uint256, size_t> > compare;
+    size_t nNext = 0;
+    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
+    for (int nRound = 0; nRound < std::min(64, (int)vCandidates.size()); nRound++) {
+        // add an interval section to the current selection round
+        nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
+
+        // every unselected candidate up to the stop time competes; if there is
+        // none, the next candidate in timestamp order is taken regardless
+        while (nNext < vCandidates.size() && (vCandidates[nNext].nTime <= nSelectionIntervalStop || vHeap.empty())) {
+            const CBlockIndex* pindex = vCandidates[nNext].pindex;
+
+            // compute the selection hash by hashing an input that is unique to that block
+            uint256 hashProof;
+            if (fModifierV2)
+                hashProof = pindex->GetBlockHash();
+            else
+                hashProof = pindex->IsProofOfStake() ? 0 : pindex->GetBlockHash();
+
+            CDataStream ss(SER_GETHASH, 0);
+            ss << hashProof << nStakeModifierPrev;
+            uint256 hashSelection = Hash(ss.begin(), ss.end());
+
+            // the selection hash is divided by 2**32 so that proof-of-stake block
+            // is always favored over proof-of-work block. this is to preserve
+            // the energy efficiency property
+            if (pindex->IsProofOfStake())
+                hashSelection >>= 32;
+
+            vHeap.push_back(std::make_pair(hashSelection, nNext));
+            std::push_heap(vHeap.begin(), vHeap.end(), compare);
+            nNext++;
         }
+        if (vHeap.empty())
+            return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
+
+        std::pop_heap(vHeap.begin(), vHeap.end(), compare);
+        const CBlockIndex* pindex = vCandidates[vHeap.back().second].pindex;
+        if (GetBoolArg("-printstakemodifier", false))
+            LogPrintf("SelectBlockFromCandidates: selection hash=%s\n", vHeap.back().first.ToString().c_str());
+        vHeap.pop_back();
+
+        // write the entropy bit of the selected block
+        nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
+        vSelected.push_back(pindex);
+        if (fDebug || GetBoolArg("-printstakemodifier", false))
+            LogPrintf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
+                nRound, DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
     }
-    if (GetBoolArg("-printstakemodifier", false))
-        LogPrintf("SelectBlockFromCandidates: selection hash=%s\n", hashBest.ToString().c_str());
-    return fSelected;
+    return true;
+}
+
+CStakeModifierWindow stakeModifierWindow;
 }
 
 // Stake Modifier (hash modifier of proof-of-stake):
@@ -174,60 +293,32 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     if (nModifierTime / getIntervalVersion(fTestNet) >= pindexPrev->GetBlockTime() / getIntervalVersion(fTestNet))
         return true;
 
-    // Sort candidate blocks by timestamp
-    vector<pair<int64_t, uint256> > vSortedByTimestamp;
-    vSortedByTimestamp.reserve(64 * getIntervalVersion(fTestNet) / nStakeTargetSpacing);
+    // Sorted candidate blocks, maintained incrementally across calls
     int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
     int64_t nSelectionIntervalStart = (pindexPrev->GetBlockTime() / getIntervalVersion(fTestNet)) * getIntervalVersion(fTestNet) - nSelectionInterval;
-    const CBlockIndex* pindex = pindexPrev;
-
-    while (pindex && pindex->GetBlockTime() >= nSelectionIntervalStart) {
-        vSortedByTimestamp.push_back(make_pair(pindex->GetBlockTime(), pindex->GetBlockHash()));
-        pindex = pindex->pprev;
-    }
-
-    int nHeightFirstCandidate = pindex ? (pindex->nHeight + 1) : 0;
-    reverse(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
-    sort(vSortedByTimestamp.begin(), vSortedByTimestamp.end());
+    int nHeightFirstCandidate = stakeModifierWindow.Load(pindexPrev, nSelectionIntervalStart);
 
     // Select 64 blocks from candidate blocks to generate stake modifier
     uint64_t nStakeModifierNew = 0;
-    int64_t nSelectionIntervalStop = nSelectionIntervalStart;
-    map<uint256, const CBlockIndex*> mapSelectedBlocks;
-    for (int nRound = 0; nRound < min(64, (int)vSortedByTimestamp.size()); nRound++) {
-        // add an interval section to the current selection round
-        nSelectionIntervalStop += GetStakeModifierSelectionIntervalSection(nRound);
-
-        // select a block from the candidates of current round
-        if (!SelectBlockFromCandidates(vSortedByTimestamp, mapSelectedBlocks, nSelectionIntervalStop, nStakeModifier, &pindex))
-            return error("ComputeNextStakeModifier: unable to select block at round %d", nRound);
-
-        // write the entropy bit of the selected block
-        nStakeModifierNew |= (((uint64_t)pindex->GetStakeEntropyBit()) << nRound);
-
-        // add the selected block from candidates to selected list
-        mapSelectedBlocks.insert(make_pair(pindex->GetBlockHash(), pindex));
-        if (fDebug || GetBoolArg("-printstakemodifier", false))
-            LogPrintf("ComputeNextStakeModifier: selected round %d stop=%s height=%d bit=%d\n",
-                nRound, DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nSelectionIntervalStop).c_str(), pindex->nHeight, pindex->GetStakeEntropyBit());
-    }
+    if (!stakeModifierWindow.Select(nSelectionIntervalStart, nStakeModifier, nStakeModifierNew))
+        return false;
 
     // Print selection map for visualization of the selected blocks
     if (fDebug || GetBoolArg("-printstakemodifier", false)) {
         string strSelectionMap = "";
         // '-' indicates proof-of-work blocks not selected
         strSelectionMap.insert(0, pindexPrev->nHeight - nHeightFirstCandidate + 1, '-');
-        pindex = pindexPrev;
+        const CBlockIndex* pindex = pindexPrev;
         while (pindex && pindex->nHeight >= nHeightFirstCandidate) {
             // '=' indicates proof-of-stake blocks not selected
             if (pindex->IsProofOfStake())
                 strSelectionMap.replace(pindex->nHeight - nHeightFirstCandidate, 1, "=");
             pindex = pindex->pprev;
         }
-        BOOST_FOREACH (const PAIRTYPE(uint256, const CBlockIndex*) & item, mapSelectedBlocks) {
+        BOOST_FOREACH (const CBlockIndex* pindexSelected, stakeModifierWindow.vSelected) {
             // 'S' indicates selected proof-of-stake blocks
             // 'W' indicates selected proof-of-work blocks
-            strSelectionMap.replace(item.second->nHeight - nHeightFirstCandidate, 1, item.second->IsProofOfStake() ? "S" : "W");
+            strSelectionMap.replace(pindexSelected->nHeight - nHeightFirstCandidate, 1, pindexSelected->IsProofOfStake() ? "S" : "W");
         }
         LogPrintf("ComputeNextStakeModifier: selection height [%d, %d] map %s\n", nHeightFirstCandidate, pindexPrev->nHeight, strSelectionMap.c_str());
     }
@@ -361,41 +452,350 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
     return fSuccess;
 }
 
+void CStakeKernelSearch::Clear()
+{
+    vchPrefix.clear();
+    vTarget.clear();
+    vValue.clear();
+    vTimeBlockFrom.clear();
+    vPrevout.clear();
+    vpindexFrom.clear();
+    vModifierResolved.clear();
+    pindexModifierTip = NULL;
+    nBitsPrepared = 0;
+}
+
+size_t CStakeKernelSearch::Add(const COutPoint& prevout, int64_t nValue, const CBlockIndex* pindexFrom)
+{
+    assert(pindexFrom);
+    vchPrefix.resize(vchPrefix.size() + PREFIX_SIZE);
+    vTarget.push_back(0);
+    vValue.push_back(nValue);
+    vTimeBlockFrom.push_back(pindexFrom->GetBlockTime());
+    vPrevout.push_back(prevout);
+    vpindexFrom.push_back(pindexFrom);
+    vModifierResolved.push_back(false);
+
+    // force Prepare() to fill in the new slot
+    pindexModifierTip = NULL;
+    nBitsPrepared = 0;
+    return vpindexFrom.size() - 1;
+}
+
+void CStakeKernelSearch::ResolveModifier(size_t nIndex)
+{
+    // Same fallback as CheckStakeKernelHash: an unresolvable modifier hashes as 0
+    uint64_t nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    vModifierResolved[nIndex] = GetKernelStakeModifier(vpindexFrom[nIndex]->GetBlockHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false);
+
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier << vTimeBlockFrom[nIndex] << vPrevout[nIndex].n << vPrevout[nIndex].hash;
+    assert(ss.size() == PREFIX_SIZE);
+    memcpy(&vchPrefix[nIndex * PREFIX_SIZE], &ss[0], PREFIX_SIZE);
+}
+
+void CStakeKernelSearch::Prepare(unsigned int nBits)
+{
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip != pindexModifierTip) {
+        // After a reorg every modifier may have moved; otherwise only the
+        // ones that could not be resolved yet can change
+        bool fReorg = !pindexModifierTip || !chainActive.Contains(pindexModifierTip);
+        for (size_t i = 0; i < size(); i++) {
+            if (fReorg || !vModifierResolved[i])
+                ResolveModifier(i);
+        }
+        pindexModifierTip = pindexTip;
+    }
+
+    if (nBits != nBitsPrepared) {
+        uint256 bnTargetPerCoinDay;
+        bnTargetPerCoinDay.SetCompact(nBits);
+        for (size_t i = 0; i < size(); i++)
+            vTarget[i] = (uint256(vValue[i]) / 100) * bnTargetPerCoinDay;
+        nBitsPrepared = nBits;
+    }
+}
+
+bool CStakeKernelSearch::IsMature(size_t nIndex, unsigned int nTimeTx) const
+{
+    unsigned int nTimeBlockFrom = vTimeBlockFrom[nIndex];
+    return nTimeTx >= nTimeBlockFrom && nTimeBlockFrom + nStakeMinAge <= nTimeTx;
+}
+
+bool CStakeKernelSearch::CheckCandidate(size_t nIndex, unsigned int nTimeTx, unsigned int nHashDrift, unsigned int& nTimeTxRet, uint256& hashProofOfStake) const
+{
+    if (!IsMature(nIndex, nTimeTx))
+        return false;
+
+    unsigned char vchKernel[PREFIX_SIZE + sizeof(unsigned int)];
+    memcpy(vchKernel, &vchPrefix[nIndex * PREFIX_SIZE], PREFIX_SIZE);
+    for (unsigned int i = 0; i < nHashDrift; i++) {
+        unsigned int nTryTime = nTimeTx + nHashDrift - i;
+        memcpy(vchKernel + PREFIX_SIZE, &nTryTime, sizeof(nTryTime));
+        uint256 hashProof = Hash(vchKernel, vchKernel + sizeof(vchKernel));
+        if (hashProof < vTarget[nIndex]) {
+            nTimeTxRet = nTryTime;
+            hashProofOfStake = hashProof;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Worker threads of a parallel kernel search, kept between searches. A search
+ * is split into nThreads stripes of the candidate table; the calling thread
+ * hashes the first one and the workers the others.
+ */
+class CStakeSearchWorkers
+{
+public:
+    CStakeSearchWorkers(int nThreadsIn) : nThreads(nThreadsIn), nGeneration(0), nPending(0), fQuit(false)
+    {
+        for (int n = 1; n < nThreads; n++)
+            threads.create_thread(boost::bind(&CStakeSearchWorkers::Loop, this, n));
+    }
+
+    ~CStakeSearchWorkers()
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            fQuit = true;
+        }
+        condWork.notify_all();
+        threads.join_all();
+    }
+
+    int GetThreads() const { return nThreads; }
+
+    // Search from nIndexIn; returns the lowest index with a kernel, or
+    // pSearch->size() if there is none
+    size_t Search(const CStakeKernelSearch* pSearchIn, size_t nIndexIn, unsigned int nTimeTxIn, unsigned int nHashDriftIn, unsigned int& nTimeTxRet, uint256& hashProofOfStake)
+    {
+        // the workers point into this search until they are all done
+        boost::this_thread::disable_interruption di;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            pSearch = pSearchIn;
+            nFirst = nIndexIn;
+            nTimeTx = nTimeTxIn;
+            nHashDrift = nHashDriftIn;
+            nBestIndex = pSearch->size();
+            nPending = nThreads - 1;
+            nGeneration++;
+        }
+        condWork.notify_all();
+
+        Stripe(0);
+
+        boost::mutex::scoped_lock lock(mutex);
+        while (nPending > 0)
+            condDone.wait(lock);
+        if (nBestIndex < pSearch->size()) {
+            nTimeTxRet = nTimeFound;
+            hashProofOfStake = hashProofFound;
+        }
+        return nBestIndex;
+    }
+
+private:
+    void Loop(int nStripe)
+    {
+        uint64_t nSeen = 0;
+        while (true) {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                while (!fQuit && nGeneration == nSeen)
+                    condWork.wait(lock);
+                if (fQuit)
+                    return;
+                nSeen = nGeneration;
+            }
+            Stripe(nStripe);
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (--nPending == 0)
+                    condDone.notify_one();
+            }
+        }
+    }
+
+    void Stripe(int nStripe)
+    {
+        for (size_t i = nFirst + nStripe; i < pSearch->size(); i += nThreads) {
+            {
+                // another stripe already found an earlier kernel
+                boost::mutex::scoped_lock lock(mutex);
+                if (i > nBestIndex)
+                    return;
+            }
+            unsigned int nTimeTxCandidate;
+            uint256 hashProofCandidate;
+            if (pSearch->CheckCandidate(i, nTimeTx, nHashDrift, nTimeTxCandidate, hashProofCandidate)) {
+                boost::mutex::scoped_lock lock(mutex);
+                if (i < nBestIndex) {
+                    nBestIndex = i;
+                    nTimeFound = nTimeTxCandidate;
+                    hashProofFound = hashProofCandidate;
+                }
+                return; // the rest of this stripe has higher indexes
+            }
+        }
+    }
+
+    const int nThreads;
+    boost::thread_group threads;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork; // a search was posted, or fQuit set
+    boost::condition_variable condDone; // the last worker finished its stripe
+    uint64_t nGeneration;               // number of searches posted so far
+    int nPending;                       // workers still busy with the current search
+    bool fQuit;
+
+    // The current search, set before it is posted
+    const CStakeKernelSearch* pSearch;
+    size_t nFirst;
+    unsigned int nTimeTx;
+    unsigned int nHashDrift;
+
+    // Lowest index with a kernel so far, pSearch->size() if none
+    size_t nBestIndex;
+    unsigned int nTimeFound;
+    uint256 hashProofFound;
+};
+
+// Constructor and destructor need CStakeSearchWorkers to be complete
+CStakeKernelSearch::CStakeKernelSearch()
+{
+    Clear();
+}
+
+CStakeKernelSearch::~CStakeKernelSearch()
+{
+}
+
+
+bool CStakeKernelSearch::Search(unsigned int nTimeTx, unsigned int nHashDrift, size_t& nIndex, unsigned int& nTimeTxRet, uint256& hashProofOfStake, int nThreads) const
+{
+    bool fHashed = false;
+    for (size_t i = nIndex; i < size() && !fHashed; i++)
+        fHashed = IsMature(i, nTimeTx);
+
+    bool fSuccess = false;
+    if (fHashed && nThreads > 1 && size() - nIndex > 1) {
+        if (!workers || workers->GetThreads() != nThreads)
+            workers.reset(new CStakeSearchWorkers(nThreads));
+        nIndex = workers->Search(this, nIndex, nTimeTx, nHashDrift, nTimeTxRet, hashProofOfStake);
+        fSuccess = nIndex < size();
+    } else {
+        for (; nIndex < size(); nIndex++) {
+            if (CheckCandidate(nIndex, nTimeTx, nHashDrift, nTimeTxRet, hashProofOfStake)) {
+                fSuccess = true;
+                break;
+            }
+        }
+    }
+
+    if (fSuccess && fDebug) {
+        uint64_t nStakeModifier;
+        memcpy(&nStakeModifier, &vchPrefix[nIndex * PREFIX_SIZE], sizeof(nStakeModifier));
+        LogPrintf("CStakeKernelSearch::Search() : pass modifier=%s nTimeBlockFrom=%u prevoutHash=%s nPrevout=%u nTimeTx=%u hashProof=%s\n",
+            boost::lexical_cast<std::string>(nStakeModifier).c_str(), vTimeBlockFrom[nIndex],
+            vPrevout[nIndex].hash.ToString().c_str(), vPrevout[nIndex].n, nTimeTxRet, hashProofOfStake.ToString().c_str());
+    }
+
+    if (fHashed) {
+        mapHashedBlocks.clear();
+        mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
+    }
+    return fSuccess;
+}
+
+/** What CheckProofOfStake needs to know about a kernel input */
+struct CStakeKernelContext {
+    CTxOut txout;                       // the output being staked
+    const CBlockIndex* pindexFrom;      // block containing it
+    uint64_t nStakeModifier;            // kernel stake modifier, 0 if not resolvable yet
+};
+
+// Find the kernel input without reading the transaction or its block from disk
+// when possible
+static bool GetStakeKernelContext(const COutPoint& prevout, CStakeKernelContext& ctx)
+{
+    AssertLockHeld(cs_main);
+
+    // The UTXO set knows output and height for unspent kernels, which is
+    // every kernel of a block extending the tip
+    ctx.pindexFrom = NULL;
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    if (coins && coins->IsAvailable(prevout.n) && coins->nHeight <= chainActive.Height()) {
+        ctx.txout = coins->vout[prevout.n];
+        ctx.pindexFrom = chainActive[coins->nHeight];
+    } else {
+        uint256 hashBlock;
+        CTransaction txPrev;
+        if (!GetTransaction(prevout.hash, txPrev, hashBlock, true))
+            return error("GetStakeKernelContext() : INFO: read txPrev failed");
+        if (prevout.n >= txPrev.vout.size())
+            return error("GetStakeKernelContext() : prevout %s out of range", prevout.ToString());
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi == mapBlockIndex.end())
+            return error("GetStakeKernelContext() : read block failed");
+        ctx.txout = txPrev.vout[prevout.n];
+        ctx.pindexFrom = mi->second;
+    }
+
+    // Same fallback as CheckStakeKernelHash: an unresolvable modifier hashes as 0
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    ctx.nStakeModifier = 0;
+    GetKernelStakeModifier(ctx.pindexFrom->GetBlockHash(), ctx.nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fDebug);
+    return true;
+}
+
+void ClearStakeModifierWindow()
+{
+    LOCK(cs_main);
+    stakeModifierWindow.Clear();
+}
+
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
-        return error("CheckProofOfStake() : INFO: read txPrev failed");
+    CStakeKernelContext ctx;
+    if (!GetStakeKernelContext(txin.prevout, ctx))
+        return error("CheckProofOfStake() : INFO: kernel input %s not found", txin.prevout.ToString());
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, ctx.txout.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
+    // The block index already carries the header time of the block containing the kernel
+    unsigned int nTimeTx = block.nTime;
+    unsigned int nTimeBlockFrom = ctx.pindexFrom->GetBlockTime();
+    if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
+        return error("CheckProofOfStake() : nTime violation");
+    if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+        return error("CheckProofOfStake() : min age violation - nTimeBlockFrom=%d nStakeMinAge=%d nTimeTx=%d", nTimeBlockFrom, nStakeMinAge, nTimeTx);
 
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(block.nBits);
 
-    unsigned int nInterval = 0;
-    unsigned int nTime = block.nTime;
-    if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
+    CDataStream ss(SER_GETHASH, 0);
+    ss << ctx.nStakeModifier;
+    hashProofOfStake = stakeHash(nTimeTx, ss, txin.prevout.n, txin.prevout.hash, nTimeBlockFrom);
+    if (!stakeTargetHit(hashProofOfStake, ctx.txout.nValue, bnTargetPerCoinDay))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -6,6 +6,7 @@
 
 #include "main.h"
 
+#include <boost/scoped_ptr.hpp>
 
 // MODIFIER_INTERVAL: time to elapse before new modifier is computed
 static const unsigned int MODIFIER_INTERVAL = 60;
@@ -13,6 +14,11 @@ static const unsigned int MODIFIER_INTERVAL_TESTNET = 60;
 extern unsigned int nModifierInterval;
 extern unsigned int getIntervalVersion(bool fTestNet);
 
+// Default and maximum number of threads hashing stake kernels (-stakethreads)
+static const int DEFAULT_STAKE_THREADS = 1;
+static const int MAX_STAKE_THREADS = 16;
+extern int nStakeThreads;
+
 // MODIFIER_INTERVAL_RATIO:
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
@@ -28,7 +34,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTra
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
@@ -39,7 +45,71 @@ unsigned int GetStakeModifierChecksum(const CBlockIndex* pindex);
 // Check stake modifier hard checkpoints
 bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierChecksum);
 
+// Forget the candidate blocks ComputeNextStakeModifier keeps between calls,
+// before the block index they point into is unloaded
+void ClearStakeModifierWindow();
+
 // Get time weight using supplied timestamps
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 
+class CStakeSearchWorkers;
+
+/**
+ * Kernel search engine used by the stake minter.
+ *
+ * For every candidate output the part of the kernel that does not depend on
+ * the coinstake time (stake modifier, nTimeBlockFrom, prevout n and hash) is
+ * serialized once into a flat table, together with the weighted target for
+ * the current nBits.  A search then only has to append nTimeTx and hash,
+ * instead of re-reading headers and rebuilding streams for every time slot.
+ * Stake modifiers are re-resolved only when the active chain moves.
+ */
+class CStakeKernelSearch
+{
+public:
+    // Size of the invariant kernel prefix: modifier, nTimeBlockFrom, n, hash
+    static const size_t PREFIX_SIZE = 8 + 4 + 4 + 32;
+
+    CStakeKernelSearch();
+    ~CStakeKernelSearch();
+
+    void Clear();
+    size_t size() const { return vpindexFrom.size(); }
+    bool empty() const { return vpindexFrom.empty(); }
+
+    // Append a candidate output; returns its index in the table
+    size_t Add(const COutPoint& prevout, int64_t nValue, const CBlockIndex* pindexFrom);
+
+    // Refresh stake modifiers against chainActive and targets for nBits (requires cs_main)
+    void Prepare(unsigned int nBits);
+
+    // Scan candidates starting at nIndex for a kernel in (nTimeTx, nTimeTx + nHashDrift].
+    // On success nIndex, nTimeTxRet and hashProofOfStake describe the kernel found.
+    // With nThreads > 1 the candidates are striped over the calling thread and
+    // nThreads - 1 workers, which are kept for the next search; the result is
+    // still the first kernel in table order. Not to be called concurrently.
+    bool Search(unsigned int nTimeTx, unsigned int nHashDrift, size_t& nIndex, unsigned int& nTimeTxRet, uint256& hashProofOfStake, int nThreads = 1) const;
+
+    // Hash a single candidate over the drift window, newest time first
+    bool CheckCandidate(size_t nIndex, unsigned int nTimeTx, unsigned int nHashDrift, unsigned int& nTimeTxRet, uint256& hashProofOfStake) const;
+
+private:
+    void ResolveModifier(size_t nIndex);
+    bool IsMature(size_t nIndex, unsigned int nTimeTx) const;
+
+    // Structure of arrays, one slot per candidate
+    std::vector<unsigned char> vchPrefix;
+    std::vector<uint256> vTarget;
+    std::vector<int64_t> vValue;
+    std::vector<unsigned int> vTimeBlockFrom;
+    std::vector<COutPoint> vPrevout;
+    std::vector<const CBlockIndex*> vpindexFrom;
+    std::vector<bool> vModifierResolved;
+
+    const CBlockIndex* pindexModifierTip;
+    unsigned int nBitsPrepared;
+
+    mutable boost::scoped_ptr<CStakeSearchWorkers> workers;
+};
+
 #endif // BITCOIN_KERNEL_H
@@ -49,6 +49,11 @@ public:
         batch.Put(slKey, slValue);
     }
 
+    void Clear()
+    {
+        batch.Clear();
+    }
+
     template <typename K>
     void Erase(const K& key)
     {
@@ -32,12 +32,18 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 
+#include <deque>
 #include <sstream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -69,7 +75,8 @@ bool fTxIndex = true;
 bool fHavePruned = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+size_t nBlockCacheSize = DEFAULT_BLOCK_CACHE_SIZE << 20;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 1 * 60; // TODO CHANGE DEMO
@@ -235,32 +242,79 @@ int GetMNTierByCollateral(int nHeight, int64_t value) {
     return 0;
 }
 
-map<string, int> mapMNTierByVin;
+CCriticalSection cs_mapMNTierByVin;
+map<COutPoint, int> mapMNTierByVin;
 
 int GetMNTierByVin(const COutPoint &mnvin) {
-    string key = mnvin.hash.ToString() + strprintf("%d", mnvin.n);
-    map<string, int>::iterator it = mapMNTierByVin.find(key);
-    if (it != mapMNTierByVin.end())
-        return it->second;
+    {
+        LOCK(cs_mapMNTierByVin);
+        map<COutPoint, int>::iterator it = mapMNTierByVin.find(mnvin);
+        if (it != mapMNTierByVin.end())
+            return it->second;
+    }
 
+    // With -txindex, collateral outputs are indexed when their block connects.
+    // Only outputs from before the index existed need the transaction itself.
+    // Misses are cached as tier 0 until ConnectBlock sees the output.
     int tier = 0;
-    CTransaction txin;
-    uint256 hashBlockPrev;
-    if (GetTransaction(mnvin.hash, txin, hashBlockPrev, true)) {
-        if(mnvin.n < txin.vout.size()) {
-            BOOST_FOREACH(PAIRTYPE(const int, int) & mntier, masternodeTiers)
-            {
-                if(mntier.second * COIN == txin.vout[mnvin.n].nValue) {
-                    tier = mntier.first;
-                    break;
-                }
-            }
+    if (!fTxIndex || !pblocktree->ReadMNTier(mnvin, tier)) {
+        CTransaction txin;
+        uint256 hashBlockPrev;
+        if (GetTransaction(mnvin.hash, txin, hashBlockPrev, true)) {
+            if (mnvin.n < txin.vout.size())
+                tier = GetMNTierByCollateral(0, txin.vout[mnvin.n].nValue);
+            if (fTxIndex && tier > 0 && !hashBlockPrev.IsNull())
+                pblocktree->WriteMNTiers(std::vector<std::pair<COutPoint, int> >(1, std::make_pair(mnvin, tier)));
         }
     }
-    mapMNTierByVin.insert(std::make_pair(key, tier));
+
+    LOCK(cs_mapMNTierByVin);
+    mapMNTierByVin.insert(std::make_pair(mnvin, tier));
     return tier;
 }
 
+bool IndexMNTiers(const CBlock& block, int nHeight)
+{
+    std::vector<std::pair<COutPoint, int> > vMNTiers;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        for (unsigned int j = 0; j < tx.vout.size(); j++) {
+            int tier = GetMNTierByCollateral(nHeight, tx.vout[j].nValue);
+            if (tier > 0)
+                vMNTiers.push_back(std::make_pair(COutPoint(tx.GetHash(), j), tier));
+        }
+    }
+    if (vMNTiers.empty())
+        return true;
+
+    if (fTxIndex && !pblocktree->WriteMNTiers(vMNTiers))
+        return false;
+
+    // replace any tier 0 cached while the collateral was unconfirmed
+    LOCK(cs_mapMNTierByVin);
+    for (std::vector<std::pair<COutPoint, int> >::const_iterator it = vMNTiers.begin(); it != vMNTiers.end(); it++)
+        mapMNTierByVin[it->first] = it->second;
+    return true;
+}
+
+bool EraseMNTiers(const CBlock& block, int nHeight)
+{
+    std::vector<COutPoint> vErase;
+    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        for (unsigned int j = 0; j < tx.vout.size(); j++)
+            if (GetMNTierByCollateral(nHeight, tx.vout[j].nValue) > 0)
+                vErase.push_back(COutPoint(tx.GetHash(), j));
+    }
+    if (vErase.empty())
+        return true;
+
+    {
+        LOCK(cs_mapMNTierByVin);
+        BOOST_FOREACH (const COutPoint& outpoint, vErase)
+            mapMNTierByVin.erase(outpoint);
+    }
+    return !fTxIndex || pblocktree->EraseMNTiers(vErase);
+}
+
 void RegisterValidationInterface(CValidationInterface* pwalletIn)
 {
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
@@ -1141,8 +1195,17 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age)
+{
+    int expired = pool.Expire(GetTime() - age);
+    if (expired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", expired);
+
+    pool.TrimToSize(limit);
+}
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/** AcceptToMemoryPool, with the time the transaction is recorded to have entered the pool */
+static bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectInsaneFee = false, bool ignoreFees = false, bool fOverrideMempoolLimit = false)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1258,7 +1321,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         CAmount nFees = nValueIn - nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1298,11 +1361,35 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             }
         }
 
+        // Once the pool has been full, it takes the fee rate of what was
+        // evicted to get back in, for a while. Like the relay fee above, this
+        // only applies to transactions subject to free-transaction limits.
+        CAmount nModifiedFees = nFees;
+        double dPriorityDummy = 0;
+        pool.ApplyDeltas(hash, dPriorityDummy, nModifiedFees);
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (fLimitFree && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nModifiedFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         if (fRejectInsaneFee && nFees > ::minRelayTxFee.GetFee(nSize) * 10000)
             return error("AcceptToMemoryPool: : insane fees %s, %d > %d",
                          hash.ToString(),
                          nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit. This bounds the work
+        // of keeping the ancestor and descendant statistics of the pool.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+            return state.DoS(0, error("AcceptToMemoryPool : too long mempool chain %s: %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
@@ -1323,7 +1410,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            if (!pool.exists(hash))
+                return state.DoS(0, error("AcceptToMemoryPool : mempool full, %s not kept", hash.ToString()),
+                                 REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1331,6 +1426,11 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, bool fOverrideMempoolLimit)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectInsaneFee, ignoreFees, fOverrideMempoolLimit);
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee)
 {
     //AAAA
@@ -1523,6 +1623,140 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
     return true;
 }
 
+namespace
+{
+/** Rough heap footprint of a block, used to keep the recent block cache within nBlockCacheSize */
+size_t BlockMemoryUsage(const CBlock& block)
+{
+    size_t nUsage = sizeof(CBlock) + ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_FOREACH (const CTransaction& tx, block.vtx)
+        nUsage += sizeof(CTransaction) + tx.vin.size() * sizeof(CTxIn) + tx.vout.size() * sizeof(CTxOut);
+    return nUsage;
+}
+
+} // anon namespace
+
+void CRecentBlockCache::Add(const CBlock& block)
+{
+    CEntry entry;
+    entry.hash = block.GetHash();
+    entry.nUsage = BlockMemoryUsage(block);
+    if (entry.nUsage > nBlockCacheSize)
+        return;
+
+    LOCK(cs);
+    if (mapEntries.count(entry.hash))
+        return;
+    entry.pblock.reset(new CBlock(block));
+    listEntries.push_front(entry);
+    mapEntries[entry.hash] = listEntries.begin();
+    nUsage += entry.nUsage;
+    while (nUsage > nBlockCacheSize) {
+        nUsage -= listEntries.back().nUsage;
+        mapEntries.erase(listEntries.back().hash);
+        listEntries.pop_back();
+    }
+}
+
+boost::shared_ptr<const CBlock> CRecentBlockCache::Get(const uint256& hash)
+{
+    LOCK(cs);
+    std::map<uint256, EntryList::iterator>::iterator it = mapEntries.find(hash);
+    if (it == mapEntries.end())
+        return boost::shared_ptr<const CBlock>();
+    listEntries.splice(listEntries.begin(), listEntries, it->second);
+    return it->second->pblock;
+}
+
+void CRecentBlockCache::Clear()
+{
+    LOCK(cs);
+    listEntries.clear();
+    mapEntries.clear();
+    nUsage = 0;
+}
+
+size_t CRecentBlockCache::DynamicMemoryUsage()
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+namespace
+{
+CRecentBlockCache recentBlocks;
+
+CPoWHashCache powHashCache;
+} // anon namespace
+
+void CPoWHashCache::Insert(const uint256& hash, const uint256& hashPoW)
+{
+    AssertLockHeld(cs);
+    if (mapPoWHash.insert(std::make_pair(hash, hashPoW)).second) {
+        dequeHashes.push_back(hash);
+        if (dequeHashes.size() > POW_HASH_CACHE_SIZE) {
+            mapPoWHash.erase(dequeHashes.front());
+            dequeHashes.pop_front();
+        }
+    }
+}
+
+uint256 CPoWHashCache::GetPoWHash(const CBlockHeader& header)
+{
+    uint256 hash = header.GetHash();
+    {
+        LOCK(cs);
+        std::map<uint256, uint256>::const_iterator it = mapPoWHash.find(hash);
+        if (it != mapPoWHash.end())
+            return it->second;
+    }
+
+    // No lock held for the expensive part
+    uint256 hashPoW = header.GetPoWHash();
+
+    LOCK(cs);
+    Insert(hash, hashPoW);
+    return hashPoW;
+}
+
+void CPoWHashCache::Fill(const std::vector<const CBlockHeader*>& vpHeaders)
+{
+    std::vector<const CBlockHeader*> vpMissing;
+    std::vector<uint256> vHash;
+    {
+        LOCK(cs);
+        BOOST_FOREACH (const CBlockHeader* pheader, vpHeaders) {
+            uint256 hash = pheader->GetHash();
+            if (!mapPoWHash.count(hash)) {
+                vpMissing.push_back(pheader);
+                vHash.push_back(hash);
+            }
+        }
+    }
+    if (vpMissing.empty())
+        return;
+
+    // The serialized header is the 80 bytes from nVersion on, as in GetPoWHash
+    std::vector<char> vInput(80 * vpMissing.size());
+    std::vector<char> vOutput(32 * vpMissing.size());
+    for (size_t i = 0; i < vpMissing.size(); i++)
+        memcpy(&vInput[80 * i], BEGIN(vpMissing[i]->nVersion), 80);
+    scrypt_1024_1_1_256_batch(&vInput[0], &vOutput[0], vpMissing.size());
+
+    LOCK(cs);
+    for (size_t i = 0; i < vpMissing.size(); i++) {
+        uint256 hashPoW;
+        memcpy(BEGIN(hashPoW), &vOutput[32 * i], 32);
+        Insert(vHash[i], hashPoW);
+    }
+}
+
+size_t CPoWHashCache::size()
+{
+    LOCK(cs);
+    return mapPoWHash.size();
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1571,8 +1805,10 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     }
 
     if (pindexSlow) {
-        CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow)) {
+        boost::shared_ptr<const CBlock> pblockRecent = recentBlocks.Get(pindexSlow->GetBlockHash());
+        CBlock blockRead;
+        if (pblockRecent || ReadBlockFromDisk(blockRead, pindexSlow)) {
+            const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
             BOOST_FOREACH (const CTransaction& tx, block.vtx) {
                 if (tx.GetHash() == hash) {
                     txOut = tx;
@@ -1613,7 +1849,7 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPoW)
 {
     block.SetNull();
 
@@ -1630,19 +1866,54 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     }
 
     // Check the header
-    if (block.IsProofOfWork()) {
-        //if (!CheckProofOfWork(block.GetHash(), block.nBits))
-        if (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+    if (fCheckPoW && block.IsProofOfWork()) {
+        if (!CheckProofOfWork(powHashCache.GetPoWHash(block), block.nBits))
             return error("ReadBlockFromDisk : Errors in block header");
     }
 
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const uint256& hash)
 {
+    // pos points past the message start and size that precede every block
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s : invalid position %d:%u", __func__, pos.nFile, pos.nPos);
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - MESSAGE_START_SIZE - sizeof(unsigned int));
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s : OpenBlockFile failed", __func__);
 
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+    try {
+        unsigned char buf[MESSAGE_START_SIZE];
+        unsigned int nSize;
+        filein >> FLATDATA(buf) >> nSize;
+        if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE) || nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("%s : no block at %d:%u", __func__, pos.nFile, pos.nPos);
+        size_t nStart = ss.size();
+        ss.resize(nStart + nSize);
+        filein.read(&ss[nStart], nSize);
+
+        // The block hash covers the 80 byte header at the start
+        if (Hash(&ss[nStart], &ss[nStart] + 80) != hash) {
+            ss.resize(nStart);
+            return error("%s : block at %d:%u is not %s", __func__, pos.nFile, pos.nPos, hash.ToString());
+        }
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+{
+    // A block only gets BLOCK_VALID_TRANSACTIONS after CheckBlock, proof of
+    // work included, passed on it before it was written. The hash check
+    // below ties what is read to that header, so there is nothing left for
+    // scrypt to find.
+    bool fTrusted = pindex->IsValid(BLOCK_VALID_TRANSACTIONS);
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), !fTrusted))
         return false;
     if (block.GetHash() != pindex->GetBlockHash()) {
         //if (block.GetPOWHash() != pindex->GetBlockHash()) {
@@ -2146,8 +2417,11 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
         }
     }
 
-    // add outputs
-    inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    // add outputs; only a coinbase can repeat the txid of one with unspent outputs
+    if (tx.IsCoinBase())
+        inputs.ModifyCoins(tx.GetHash())->FromTx(tx, nHeight);
+    else
+        inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
 }
 
 bool CScriptCheck::operator()()
@@ -2462,6 +2736,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
+
+    // Resolve the masternode tier against the chain state before this block,
+    // an unspent collateral is then found in the view without touching disk
+    int nMNTier = 0;
+    if (block.IsProofOfStake()) {
+        const CCoins* coins = view.AccessCoins(block.mnvin.hash);
+        if (coins && coins->IsAvailable(block.mnvin.n))
+            nMNTier = GetMNTierByCollateral(pindex->nHeight, coins->vout[block.mnvin.n].nValue);
+        else
+            nMNTier = GetMNTierByVin(block.mnvin);
+    }
+
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
@@ -2552,8 +2838,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         nExpectedMint += GetMasternodePayment(GetHeight(), 0, tier);
     }*/
     if(block.IsProofOfStake()) {
-        int tier = GetMNTierByVin(block.mnvin);
-        nExpectedMint += GetMasternodePayment(GetHeight(), 0, tier);
+        nExpectedMint += GetMasternodePayment(GetHeight(), 0, nMNTier);
         if (!IsBlockValueValid(block, nExpectedMint, pindex->nMint)) {
             return state.DoS(100,
                              error("ConnectBlock() : reward pays too much (actual=%s vs limit=%s) %d %d",
@@ -2601,6 +2886,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    if (!IndexMNTiers(block, pindex->nHeight))
+        return state.Abort("Failed to write masternode tier index");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2636,8 +2924,12 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -2668,10 +2960,17 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
+            // The coin database writes it in the background, and reports a
+            // failure to do so on the next flush.
             if (!pcoinsTip->Flush())
                 return state.Abort("Failed to write to coin database");
             // Update best block in wallet (so we can detect restored wallets).
+            // The wallet must not get ahead of the chainstate on disk, or
+            // after a crash it would skip the blocks the chainstate replays,
+            // so wait for the coin database to finish writing first.
             if (mode != FLUSH_STATE_IF_NEEDED) {
+                if (!pcoinsTip->Sync())
+                    return state.Abort("Failed to write to coin database");
                 g_signals.SetBestChain(chainActive.GetLocator());
             }
             nLastWrite = GetTimeMicros();
@@ -2694,7 +2993,7 @@ void FlushStateToDisk()
 // Update the on-disk chain state.
 bool static WriteChainState(CValidationState &state) {
     static int64_t nLastWrite = 0;
-    if (pcoinsTip->GetCacheSize() > nCoinCacheSize || (!IsInitialBlockDownload() && GetTimeMicros() > nLastWrite + 600*1000000)) {
+    if (pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage || (!IsInitialBlockDownload() && GetTimeMicros() > nLastWrite + 600*1000000)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -2720,10 +3019,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
               chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
               DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-              Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+              Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2766,18 +3065,32 @@ bool static DisconnectTip(CValidationState& state)
             return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
         assert(view.Flush());
     }
+    // Forget the collateral tiers of the outputs this block created. This is
+    // not done in DisconnectBlock, which VerifyDB also runs on a scratch view.
+    if (!EraseMNTiers(block, pindexDelete->nHeight))
+        return state.Abort("Failed to erase masternode tier index");
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
+    // Resurrect mempool transactions from the disconnected block. The pool
+    // is trimmed once they are all back in and linked to their children,
+    // rather than after each one while the package statistics are stale.
+    std::vector<uint256> vHashUpdate;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, false, true))
             mempool.remove(tx, removed, true);
-    }
+        else if (mempool.exists(tx.GetHash()))
+            vHashUpdate.push_back(tx.GetHash());
+    }
+    // AcceptToMemoryPool only links a new entry to its parents, but these may
+    // already have children in the pool that spent them while they were
+    // confirmed. Link those and fix up the package statistics.
+    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
@@ -2877,16 +3190,22 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
 
 // Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
 // corresponding to pindexNew, to bypass loading it again from disk.
-bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *pblock) {
+bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CBlock *pblock) {
     assert(pindexNew->pprev == chainActive.Tip());
     mempool.check(pcoinsTip);
-    // Read block from disk.
+    // Read block from disk, unless it was accepted recently.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    boost::shared_ptr<const CBlock> pblockRecent;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
-            return state.Abort("Failed to read block");
-        pblock = &block;
+        pblockRecent = recentBlocks.Get(pindexNew->GetBlockHash());
+        if (pblockRecent) {
+            pblock = pblockRecent.get();
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew))
+                return state.Abort("Failed to read block");
+            pblock = &block;
+        }
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
@@ -3503,9 +3822,7 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     // Check proof of work matches claimed amount
     //disable this check temporarily
 
-    CBlock checkBlock = CBlock(block);
-
-    if (fCheckPOW && !CheckProofOfWork(checkBlock.GetPoWHash(), checkBlock.nBits))
+    if (fCheckPOW && !CheckProofOfWork(powHashCache.GetPoWHash(block), block.nBits))
         return state.DoS(50, error("CheckBlockHeader() : proof of work failed"),
                          REJECT_INVALID, "high-hash");
 
@@ -3525,6 +3842,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 {
     // These are checks that are independent of context.
 
+    // Blocks reach this more than once (ProcessNewBlock, AcceptBlock), and
+    // the block importer runs it ahead of time on its worker threads
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
 
@@ -3656,6 +3978,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
             REJECT_INVALID, "bad-blk-sigops", true);
 */
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
     return true;
 }
 
@@ -3877,6 +4201,9 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
                 return state.Abort("Failed to write block");
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock() : ReceivedBlockTransactions failed");
+        // imported blocks are already on disk and connected in file order
+        if (dbp == NULL)
+            recentBlocks.Add(block);
     } catch (std::runtime_error& e) {
         return state.Abort(std::string("System error: ") + e.what());
     }
@@ -4442,7 +4769,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4485,6 +4812,8 @@ void UnloadBlockIndex()
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    ClearStakeModifierWindow();
+    recentBlocks.Clear();
 }
 
 bool LoadBlockIndex()
@@ -4640,125 +4969,441 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
 }
 */
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+CImportBlock::CImportBlock() : ssRaw(SER_DISK, CLIENT_VERSION), nSize(0), fHavePos(false), fParsed(false), fReadable(false) {}
+
+CBlockImporter::CBlockImporter(FILE* fileIn, const CDiskBlockPos* dbp) : fileSingle(fileIn), fReindexFiles(false), fHavePos(dbp != NULL)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    if (dbp)
+        posFile = *dbp;
+    Start();
+}
 
-    int nLoaded = 0;
+CBlockImporter::CBlockImporter() : fileSingle(NULL), fReindexFiles(true), posFile(0, 0), fHavePos(true)
+{
+    Start();
+}
+
+void CBlockImporter::Start()
+{
+    itNextParse = listBlocks.end();
+    nBytesInFlight = 0;
+    fReadDone = false;
+    fStop = false;
+
+    // One worker more than there are script check threads: parsing competes
+    // with ConnectBlock for the cores, but should never fall behind it
+    int nWorkers = std::max(1, std::min(nScriptCheckThreads, MAX_SCRIPTCHECK_THREADS)) + 1;
+    threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+    for (int i = 0; i < nWorkers; i++)
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadParse, this));
+}
+
+CBlockImporter::~CBlockImporter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+    }
+    condRead.notify_all();
+    condParse.notify_all();
+    threads.join_all();
+
+    BOOST_FOREACH (CImportBlock* pblock, listBlocks)
+        delete pblock;
+    if (fileSingle)
+        fclose(fileSingle);
+}
+
+CImportBlock* CBlockImporter::Front()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true) {
+        if (!listBlocks.empty() && listBlocks.front()->fParsed)
+            return listBlocks.front();
+        if (listBlocks.empty() && fReadDone)
+            return NULL;
+        condConnect.wait(lock);
+    }
+}
+
+void CBlockImporter::PopFront()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        CImportBlock* pblock = listBlocks.front();
+        assert(pblock->fParsed && itNextParse != listBlocks.begin());
+        nBytesInFlight -= pblock->nSize;
+        listBlocks.pop_front();
+        delete pblock;
+    }
+    condRead.notify_one();
+}
+
+std::string CBlockImporter::GetReadError()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return strReadError;
+}
+
+bool CBlockImporter::OpenNextFile(FILE*& file)
+{
+    if (!fReindexFiles) {
+        // the single file is only read once, and closed by the destructor
+        file = fileSingle;
+        fileSingle = NULL;
+        return file != NULL;
+    }
+
+    if (!boost::filesystem::exists(GetBlockPosFilename(posFile, "blk")))
+        return false; // No block files left to reindex
+    file = OpenBlockFile(posFile, true);
+    if (!file)
+        return false; // This error is logged in OpenBlockFile
+    LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)posFile.nFile);
+    return true;
+}
+
+bool CBlockImporter::ReadFile(FILE* file)
+{
+#if defined(POSIX_FADV_SEQUENTIAL)
+    // The file is read front to back exactly once
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // This takes over file and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(file, IMPORT_READ_BUFFER_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+    uint64_t nStartByte = 0;
+    if (fHavePos) {
+        // (try to) skip already indexed part
+        CBlockFileInfo info;
+        if (pblocktree->ReadBlockFileInfo(posFile.nFile, info)) {
+            nStartByte = info.nSize;
+            blkdat.Seek(info.nSize);
+        }
+    }
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        blkdat.SetPos(nRewind);
+        nRewind++;         // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos() + 1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+
+        uint64_t nBlockPos = blkdat.GetPos();
+        if (nBlockPos < nStartByte) // skip already indexed part
+            continue;
+
+        CImportBlock* pblock = new CImportBlock();
+        pblock->nSize = nSize;
+        pblock->fHavePos = fHavePos;
+        if (fHavePos)
+            pblock->pos = CDiskBlockPos(posFile.nFile, nBlockPos);
+        try {
+            blkdat.SetLimit(nBlockPos + nSize);
+            pblock->ssRaw.resize(nSize);
+            blkdat.read(&pblock->ssRaw[0], nSize);
+            nRewind = blkdat.GetPos();
+        } catch (const std::exception& e) {
+            LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+            delete pblock;
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!fStop && nBytesInFlight > 0 && nBytesInFlight + nSize > MAX_IMPORT_BYTES_IN_FLIGHT)
+            condRead.wait(lock);
+        if (fStop) {
+            delete pblock;
+            return false;
+        }
+        listBlocks.push_back(pblock);
+        nBytesInFlight += nSize;
+        if (itNextParse == listBlocks.end())
+            itNextParse = --listBlocks.end();
+        condParse.notify_one();
+    }
+    return true;
+}
+
+void CBlockImporter::ThreadRead()
+{
+    RenameThread("cc-loadblk-read");
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nStartByte = 0;
-        if (dbp) {
-            // (try to) skip already indexed part
-            CBlockFileInfo info;
-            if (pblocktree->ReadBlockFileInfo(dbp->nFile, info)) {
-                nStartByte = info.nSize;
-                blkdat.Seek(info.nSize);
-            }
+        FILE* file;
+        while (OpenNextFile(file)) {
+            if (!ReadFile(file) || !fReindexFiles)
+                break;
+            posFile.nFile++;
         }
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+    } catch (const std::exception& e) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strReadError = e.what();
+    }
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+    }
+    condParse.notify_all();
+    condConnect.notify_all();
+}
+
+void CBlockImporter::ThreadParse()
+{
+    RenameThread("cc-loadblk-parse");
+    while (true) {
+        // Claim up to IMPORT_PARSE_BATCH blocks, but do not wait for more
+        // than are already read
+        std::vector<CImportBlock*> vpBlocks;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && itNextParse == listBlocks.end() && !fReadDone)
+                condParse.wait(lock);
+            if (fStop || itNextParse == listBlocks.end())
+                return;
+            while (itNextParse != listBlocks.end() && vpBlocks.size() < IMPORT_PARSE_BATCH)
+                vpBlocks.push_back(*itNextParse++);
+        }
+
+        std::vector<const CBlockHeader*> vpHeadersPoW;
+        BOOST_FOREACH (CImportBlock* pblock, vpBlocks) {
             try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception &) {
-                // no valid block header found; don't complain
-                break;
+                pblock->ssRaw >> pblock->block;
+                pblock->fReadable = true;
+            } catch (const std::exception& e) {
+                LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (nBlockPos < nStartByte) // skip already indexed part
-                    continue;
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
+            pblock->ssRaw = CDataStream(SER_DISK, CLIENT_VERSION);
+            if (pblock->fReadable && pblock->block.IsProofOfWork())
+                vpHeadersPoW.push_back(&pblock->block);
+        }
+        powHashCache.Fill(vpHeadersPoW);
 
-                // read block header
-                CBlockHeader blockhdr;
-                blkdat >> blockhdr;
-                nRewind = blkdat.GetPos();
+        BOOST_FOREACH (CImportBlock* pblock, vpBlocks) {
+            if (pblock->fReadable) {
+                pblock->hash = pblock->block.GetHash();
+                // Both remember success in the block, so ProcessNewBlock does not
+                // redo the work; failures are found and reported again there
+                CValidationState state;
+                if (CheckBlock(pblock->block, state))
+                    pblock->block.CheckBlockSignature();
+            }
 
-                // process block header
-                uint256 hash = blockhdr.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(blockhdr.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                             blockhdr.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(blockhdr.hashPrevBlock, *dbp));
-                    // TODO a slight optimization would be: blkdat.Skip(nSize - 80)
-                    continue;
-                }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                pblock->fParsed = true;
+            }
+            condConnect.notify_one();
+        }
+    }
+}
 
-                // read block
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+// Map of disk positions for blocks with unknown parent (only used for reindex)
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
 
-                // process block
-                CValidationState state;
-                if (ProcessNewBlock(state, NULL, &block, dbp))
-                    nLoaded++;
+static bool ImportBlocks(CBlockImporter& importer)
+{
+    int64_t nStart = GetTimeMillis();
 
-                if (state.IsError())
-                    break;
+    int nLoaded = 0;
+    CImportBlock* pimport;
+    while ((pimport = importer.Front()) != NULL) {
+        boost::this_thread::interruption_point();
 
+        if (!pimport->fReadable) {
+            importer.PopFront();
+            continue;
+        }
+        CBlock& block = pimport->block;
+        uint256 hash = pimport->hash;
+        CDiskBlockPos* dbp = pimport->fHavePos ? &pimport->pos : NULL;
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                      head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
+        // detect out of order blocks, and store them for later
+        bool fParentKnown;
+        {
+            LOCK(cs_main);
+            fParentKnown = hash == Params().HashGenesisBlock() || mapBlockIndex.count(block.hashPrevBlock);
+        }
+        if (!fParentKnown) {
+            LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+            if (dbp)
+                mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+            importer.PopFront();
+            continue;
+        }
+
+        // process block
+        CValidationState state;
+        if (ProcessNewBlock(state, NULL, &block, dbp))
+            nLoaded++;
+        importer.PopFront();
+
+        if (state.IsError())
+            break;
+
+        // Recursively process earlier encountered successors of this block
+        deque<uint256> queue;
+        queue.push_back(hash);
+        while (!queue.empty()) {
+            uint256 head = queue.front();
+            queue.pop_front();
+            std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+            while (range.first != range.second) {
+                std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                CBlock blockChild;
+                if (ReadBlockFromDisk(blockChild, it->second)) {
+                    LogPrintf("%s: Processing out of order child %s of %s\n", __func__, blockChild.GetHash().ToString(),
+                        head.ToString());
+                    CValidationState dummy;
+                    if (ProcessNewBlock(dummy, NULL, &blockChild, &it->second)) {
+                        nLoaded++;
+                        queue.push_back(blockChild.GetHash());
                     }
                 }
-            } catch (std::exception &e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+                range.first++;
+                mapBlocksUnknownParent.erase(it);
             }
         }
-    } catch(std::runtime_error &e) {
-        AbortNode(std::string("System error: ") + e.what());
     }
+
+    std::string strReadError = importer.GetReadError();
+    if (!strReadError.empty())
+        AbortNode(std::string("System error: ") + strReadError);
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+{
+    CBlockImporter importer(fileIn, dbp);
+    return ImportBlocks(importer);
+}
+
+bool ReindexBlockFiles()
+{
+    CBlockImporter importer;
+    return ImportBlocks(importer);
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s : failed to open mempool file from disk", __func__);
+
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION)
+            return error("%s : unknown mempool file version %d", __func__, version);
+
+        // The deltas go in first, so addUnchecked applies them as the
+        // transactions come in
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+
+            if (nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime))
+                    ++count;
+                else
+                    ++failed;
+            } else {
+                ++skipped;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+    } catch (const std::exception& e) {
+        return error("%s : failed to deserialize mempool data on disk: %s", __func__, e.what());
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired\n", count, failed, skipped);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t start = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<CTransaction, int64_t> > vTx;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vTx.reserve(mempool.mapTx.size());
+        // Oldest first, so parents are accepted before their children on loading
+        CTxMemPool::indexed_transaction_set::index<entry_time>::type::const_iterator it = mempool.mapTx.get<entry_time>().begin();
+        for (; it != mempool.mapTx.get<entry_time>().end(); ++it)
+            vTx.push_back(std::make_pair(it->GetTx(), it->GetTime()));
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr)
+            return error("%s : failed to open mempool.dat.new", __func__);
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+        file << mapDeltas;
+        file << (uint64_t)vTx.size();
+        for (unsigned int i = 0; i < vTx.size(); i++) {
+            file << vTx[i].first;
+            file << vTx[i].second;
+        }
+
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t last = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid - start) * 0.000001, (last - mid) * 0.000001);
+    } catch (const std::exception& e) {
+        return error("%s : failed to dump mempool: %s", __func__, e.what());
+    }
+    return true;
+}
+
 void static CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
@@ -5028,8 +5673,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -5041,31 +5684,66 @@ void static ProcessGetData(CNode* pfrom)
             it++;
 
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+                // Only decide what to send under cs_main; reading the block
+                // from disk happens after releasing it, so serving syncing
+                // peers does not hold up validation
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end()) {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a max reorg depth than the best header
-                        // chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                               (chainActive.Height() - mi->second->nHeight < Params().MaxReorganizationDepth());
-                        if (!send) {
-                            LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                CBlockIndex* pindex = NULL;
+                CDiskBlockPos pos;
+                uint256 hashTip;
+                {
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end()) {
+                        pindex = mi->second;
+                        if (chainActive.Contains(pindex)) {
+                            send = true;
+                        } else {
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a max reorg depth than the best header
+                            // chain we know about.
+                            send = pindex->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                   (chainActive.Height() - pindex->nHeight < Params().MaxReorganizationDepth());
+                            if (!send) {
+                                LogPrintf("ProcessGetData(): ignoring request from peer=%i for old block that isn't in the main chain\n", pfrom->GetId());
+                            }
                         }
+                        pos = pindex->GetBlockPos();
+                        hashTip = chainActive.Tip()->GetBlockHash();
                     }
                 }
                 if (send) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Send block from memory if it was accepted recently, otherwise from disk
+                    boost::shared_ptr<const CBlock> pblockRecent = recentBlocks.Get(inv.hash);
+                    if (inv.type == MSG_BLOCK) {
+                        if (pblockRecent) {
+                            pfrom->PushMessage("block", *pblockRecent);
+                        } else {
+                            // The block goes out exactly as it is stored in the block file
+                            pfrom->BeginMessage("block");
+                            if (ReadRawBlockFromDisk(pfrom->ssSend, pos, inv.hash)) {
+                                pfrom->EndMessage();
+                            } else {
+                                // Not the block the index expects there; read it
+                                // through the index instead, which checks it
+                                pfrom->AbortMessage();
+                                CBlock block;
+                                {
+                                    LOCK(cs_main);
+                                    if (!ReadBlockFromDisk(block, pindex))
+                                        assert(!"cannot load block from disk");
+                                }
+                                pfrom->PushMessage("block", block);
+                            }
+                        }
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        // Blocks we send are fully validated, so the hash
+                        // check stands in for proof of work
+                        CBlock blockRead;
+                        if (!pblockRecent && (!ReadBlockFromDisk(blockRead, pos, false) || blockRead.GetHash() != inv.hash))
+                            assert(!"cannot load block from disk");
+                        const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -5091,12 +5769,14 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
             } else if (inv.IsKnownType()) {
+                LOCK(cs_main);
+
                 // Send stream from relay memory
                 bool pushed = false;
                 {
@@ -5691,6 +6371,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Reject a broken sequence before spending any scrypt on it
+        for (unsigned int n = 1; n < nCount; n++) {
+            if (headers[n].hashPrevBlock != headers[n - 1].GetHash()) {
+                Misbehaving(pfrom->GetId(), 20);
+                return error("non-continuous headers sequence");
+            }
+        }
+
+        // Hash the proof of work of the new headers that are still in the PoW
+        // era in one batch, before taking cs_main for long; the checks of their
+        // blocks find the results in powHashCache. The batch stops at the first
+        // header whose target or timestamp already rules it out.
+        std::vector<const CBlockHeader*> vpHeadersPoW;
+        if (nCount > 0) {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(headers[0].hashPrevBlock);
+            int nHeight = mi != mapBlockIndex.end() ? mi->second->nHeight + 1 : -1;
+            for (unsigned int n = 0; n < nCount && nHeight >= 0 && nHeight <= Params().LAST_POW_BLOCK(); n++, nHeight++) {
+                const CBlockHeader& header = headers[n];
+                if (mapBlockIndex.count(header.GetHash()))
+                    continue;
+                uint256 bnTarget;
+                bool fNegative, fOverflow;
+                bnTarget.SetCompact(header.nBits, &fNegative, &fOverflow);
+                if (fNegative || fOverflow || bnTarget == 0 || bnTarget > Params().ProofOfWorkLimit() ||
+                    header.GetBlockTime() > GetAdjustedTime() + 30 * 60)
+                    break;
+                vpHeadersPoW.push_back(&header);
+            }
+        }
+        powHashCache.Fill(vpHeadersPoW);
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5700,11 +6412,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CBlockIndex* pindexLast = NULL;
         BOOST_FOREACH (const CBlockHeader& header, headers) {
             CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-
             /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
              * before headers are reimplemented on mainnet
              */
@@ -6444,4 +7151,4 @@ public:
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
     }
-} instance_of_cmaincleanup;
\ No newline at end of file
+} instance_of_cmaincleanup;
@@ -31,7 +31,9 @@
 #include "undo.h"
 
 #include <algorithm>
+#include <deque>
 #include <exception>
+#include <list>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -39,6 +41,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/unordered_map.hpp>
 
 class CBlockIndex;
@@ -72,6 +76,26 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -maxmempool, maximum megabytes of memory the mempool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool, save the mempool on shutdown and load it on startup */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -blockcache, memory in MiB for recently accepted blocks */
+static const unsigned int DEFAULT_BLOCK_CACHE_SIZE = 32;
+/** Maximum for -blockcache in MiB */
+static const int64_t MAX_BLOCK_CACHE_SIZE = sizeof(void*) > 4 ? 4096 : 1024;
+/** Number of block hashes whose proof of work hash is remembered */
+static const size_t POW_HASH_CACHE_SIZE = 10000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -82,6 +106,12 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 //static const int COINBASE_MATURITY = 110;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
+/** Read buffer of the block importer (-reindex, -loadblock) */
+static const unsigned int IMPORT_READ_BUFFER_SIZE = 8 * MAX_BLOCK_SIZE;
+/** Block data the importer may have read ahead of the block being connected */
+static const unsigned int MAX_IMPORT_BYTES_IN_FLIGHT = 64 * 1000 * 1000;
+/** Blocks an importer worker claims at once, so their proof of work hashes share the scrypt lanes */
+static const unsigned int IMPORT_PARSE_BATCH = 8;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
@@ -145,7 +175,8 @@ extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+extern size_t nBlockCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
@@ -172,6 +203,10 @@ bool IsMNCollateralValid(int nHeight, int64_t value);
 int64_t GetMNCollateral(int nHeight, int tier);
 int GetMNTierByCollateral(int nHeight, int64_t value);
 int GetMNTierByVin(const COutPoint &mnvin);
+/** Record the collateral tiers of a connected block's outputs in the cache and, with -txindex, the index */
+bool IndexMNTiers(const CBlock& block, int nHeight);
+/** Drop the collateral tiers of a disconnected block's outputs from the cache and the index */
+bool EraseMNTiers(const CBlock& block, int nHeight);
 
 /** Register a wallet to receive updates from core */
 void RegisterValidationInterface(CValidationInterface* pwalletIn);
@@ -209,6 +244,8 @@ FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** Import all blk?????.dat files for -reindex, reading ahead across files */
+bool ReindexBlockFiles();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -269,10 +306,18 @@ void FlushStateToDisk();
 
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false, bool fOverrideMempoolLimit = false);
 
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false);
 
+/** Expire transactions older than age seconds, then trim the pool to limit bytes of memory */
+void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age);
+
+/** Write the mempool, with its prioritisation deltas, to mempool.dat */
+bool DumpMempool();
+/** Load the transactions of mempool.dat through AcceptToMemoryPool */
+bool LoadMempool();
+
 int GetInputAge(CTxIn& vin);
 int GetInputAgeIX(uint256 nTXHash, CTxIn& vin);
 bool GetCoinAge(const CTransaction& tx, unsigned int nTxTime, uint64_t& nCoinAge);
@@ -438,8 +483,142 @@ public:
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+/** Read a block by position, checking its proof of work unless fCheckPoW is false */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, bool fCheckPoW = true);
+/** Read the block of pindex; proof of work is only checked for blocks that have not been validated yet */
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Append the block at pos to ss as it is stored in the block file, without deserializing it;
+ *  fails, leaving ss as it was, unless its header hashes to hash */
+bool ReadRawBlockFromDisk(CDataStream& ss, const CDiskBlockPos& pos, const uint256& hash);
+
+/**
+ * The most recently accepted blocks. AcceptBlock writes every block to disk,
+ * but a block that arrived ahead of its parent, or that peers ask for right
+ * after we announced it, would otherwise be read back and deserialized (and
+ * for proof of work blocks, scrypt hashed) moments later.
+ */
+class CRecentBlockCache
+{
+private:
+    struct CEntry {
+        uint256 hash;
+        boost::shared_ptr<const CBlock> pblock;
+        size_t nUsage;
+    };
+    typedef std::list<CEntry> EntryList;
+
+    CCriticalSection cs;
+    EntryList listEntries; // most recently used first
+    std::map<uint256, EntryList::iterator> mapEntries;
+    size_t nUsage;
+
+public:
+    CRecentBlockCache() : nUsage(0) {}
+
+    /** Keep a copy of block, evicting the least recently used ones beyond nBlockCacheSize */
+    void Add(const CBlock& block);
+    /** The block with this hash, or NULL when it is not cached */
+    boost::shared_ptr<const CBlock> Get(const uint256& hash);
+    void Clear();
+    /** Approximate memory used by the cached blocks */
+    size_t DynamicMemoryUsage();
+};
+
+/**
+ * Proof of work hashes of recently checked headers, by block hash. One
+ * scrypt hash costs about as much as reading the whole block back, and the
+ * same header is checked on its way from the network to disk and again
+ * whenever it is read back by position. The block hash covers the same 80
+ * header bytes as the proof of work hash, so a changed header is never
+ * answered from here.
+ */
+class CPoWHashCache
+{
+private:
+    CCriticalSection cs;
+    std::map<uint256, uint256> mapPoWHash;
+    std::deque<uint256> dequeHashes; // oldest first
+
+    void Insert(const uint256& hash, const uint256& hashPoW);
+
+public:
+    uint256 GetPoWHash(const CBlockHeader& header);
+
+    /**
+     * Hash the proof of work of all the headers not seen yet in one batch,
+     * as many at a time as the CPU has scrypt lanes for, so that the checks
+     * that follow find them here.
+     */
+    void Fill(const std::vector<const CBlockHeader*>& vpHeaders);
+
+    /** Number of hashes remembered */
+    size_t size();
+};
+
+/** A block on its way from a block file to ProcessNewBlock */
+struct CImportBlock {
+    CDataStream ssRaw; // serialized block as found in the file, dropped once parsed
+    unsigned int nSize;
+    bool fHavePos;
+    CDiskBlockPos pos;
+    bool fParsed;   // set by a worker once the fields below are filled in
+    bool fReadable; // whether ssRaw deserialized
+    CBlock block;
+    uint256 hash;
+
+    CImportBlock();
+};
+
+/**
+ * Block import for -reindex and -loadblock in three stages: a reader thread
+ * that only frames blocks out of the files, worker threads that deserialize
+ * them and run the checks that need no chain state (proof of work, hashed for
+ * a batch of blocks at once, and block signature; the results are remembered
+ * in the CBlock), and the caller, which
+ * hands the blocks to ProcessNewBlock in file order. The reader stays at most
+ * MAX_IMPORT_BYTES_IN_FLIGHT of block data ahead of the caller.
+ */
+class CBlockImporter
+{
+public:
+    /** Import a single file; with dbp, it is block file dbp->nFile */
+    CBlockImporter(FILE* fileIn, const CDiskBlockPos* dbp);
+    /** Import all block files in order, for -reindex */
+    CBlockImporter();
+    ~CBlockImporter();
+
+    /** Wait for the next block in file order. Returns NULL at the end of the input. */
+    CImportBlock* Front();
+    /** Drop the block returned by Front() */
+    void PopFront();
+
+    /** Read error that ended the input early, if any */
+    std::string GetReadError();
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condParse;
+    boost::condition_variable condConnect;
+    std::list<CImportBlock*> listBlocks;
+    std::list<CImportBlock*>::iterator itNextParse; // first block not claimed by a worker
+    uint64_t nBytesInFlight;
+    bool fReadDone;
+    bool fStop;
+    std::string strReadError;
+    boost::thread_group threads;
+
+    FILE* fileSingle;
+    bool fReindexFiles;
+    CDiskBlockPos posFile;
+    bool fHavePos;
+
+    void Start();
+    bool OpenNextFile(FILE*& file);
+    bool ReadFile(FILE* file);
+    void ThreadRead();
+    void ThreadParse();
+};
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -16,48 +16,89 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
+// spent status of masternode collaterals
+CMasternodeCollateral masternodeCollateral;
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+// active state changes of all masternodes, see GetMasternodeStateChanges
+static CCriticalSection cs_stateChanges;
+static int64_t nStateChanges = 0;
+
+int64_t GetMasternodeStateChanges()
+{
+    LOCK(cs_stateChanges);
+    return nStateChanges;
+}
+
+//Get the hash of the block below nBlockHeight (0 means the tip's height, < 0 the tip itself)
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
-
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
+        nBlockHeight = pindexTip->nHeight;
 
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    if (pindexTip->nHeight + 1 < nBlockHeight) return false;
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+    // chainActive is indexed by height, so this is O(1) and always follows reorgs
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    const CBlockIndex* pindex = nHeight > 0 ? chainActive[nHeight] : NULL;
+    if (pindex == NULL) return false;
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    hash = pindex->GetBlockHash();
+    return true;
+}
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
+CMasternodeCollateral::Status CMasternodeCollateral::GetStatus(const COutPoint& outpoint, CAmount& nValueRet)
+{
+    {
+        LOCK(cs);
+        std::map<COutPoint, CAmount>::const_iterator it = mapUnspent.find(outpoint);
+        if (it != mapUnspent.end()) {
+            nValueRet = it->second;
+            return COLLATERAL_UNSPENT;
         }
-        n++;
+    }
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) return COLLATERAL_BUSY;
+
+    const CCoins* coins = pcoinsTip->AccessCoins(outpoint.hash);
+    if (coins == NULL || !coins->IsAvailable(outpoint.n))
+        return COLLATERAL_SPENT;
+
+    {
+        LOCK(mempool.cs);
+        if (mempool.mapNextTx.count(outpoint))
+            return COLLATERAL_SPENT;
     }
 
-    return false;
+    nValueRet = coins->vout[outpoint.n].nValue;
+
+    LOCK(cs);
+    mapUnspent[outpoint] = nValueRet;
+    return COLLATERAL_UNSPENT;
+}
+
+void CMasternodeCollateral::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    LOCK(cs);
+    if (mapUnspent.empty()) return;
+
+    // Spends in blocks or the mempool, and disconnected transactions taking
+    // their outputs with them, all force the next lookup back to the coins view
+    BOOST_FOREACH (const CTxIn& txin, tx.vin)
+        mapUnspent.erase(txin.prevout);
+
+    uint256 hash = tx.GetHash();
+    mapUnspent.erase(mapUnspent.lower_bound(COutPoint(hash, 0)),
+        mapUnspent.upper_bound(COutPoint(hash, std::numeric_limits<uint32_t>::max())));
+}
+
+void CMasternodeCollateral::Clear()
+{
+    LOCK(cs);
+    mapUnspent.clear();
 }
 
 CMasternode::CMasternode()
@@ -190,7 +231,18 @@ void CMasternode::Check(bool forceCheck)
     if (!forceCheck && (GetTime() - lastTimeChecked < MASTERNODE_CHECK_SECONDS)) return;
     lastTimeChecked = GetTime();
 
+    // counted here rather than in the manager, so a Check() through a
+    // pointer from Find() reaches the rank tables as well
+    int nActiveStatePrev = activeState;
+    UpdateActiveState();
+    if (activeState != nActiveStatePrev) {
+        LOCK(cs_stateChanges);
+        nStateChanges++;
+    }
+}
 
+void CMasternode::UpdateActiveState()
+{
     //once spent, stop doing the checks
     if (activeState == MASTERNODE_VIN_SPENT) return;
 
@@ -206,29 +258,25 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-		CMutableTransaction tx = CMutableTransaction();
-		tx.vin.push_back(vin);
-		CAmount testValue = 500000 * COIN - 0.01 * COIN;
-        if(pindexBestHeader->nHeight > TIERED_MASTERNODES_START_BLOCK) {
-			int tier = GetMNTierByVin(vin.prevout);
-			if(tier <= 0) {
-				activeState = MASTERNODE_VIN_SPENT;
-				return;
-			}
-	        testValue = GetMNCollateral(pindexBestHeader->nHeight, tier);
-		}
-		CTxOut vout = CTxOut(testValue, Params().MasternodeTestDummyAddress());
-		tx.vout.push_back(vout);
-
-		TRY_LOCK(cs_main, lockMain);
-		if (!lockMain) return;
-
-		CValidationState state;
-		if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-			activeState = MASTERNODE_VIN_SPENT;
-			return;
-		}
-	}
+        CAmount nValue = 0;
+        CMasternodeCollateral::Status status = masternodeCollateral.GetStatus(vin.prevout, nValue);
+        if (status == CMasternodeCollateral::COLLATERAL_BUSY) return;
+
+        if (status == CMasternodeCollateral::COLLATERAL_SPENT) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
+        }
+
+        if (pindexBestHeader->nHeight > TIERED_MASTERNODES_START_BLOCK) {
+            if (GetMNTierByCollateral(pindexBestHeader->nHeight, nValue) <= 0) {
+                activeState = MASTERNODE_VIN_SPENT;
+                return;
+            }
+        } else if (nValue < 500000 * COIN - 0.01 * COIN) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
+        }
+    }
 
     activeState = MASTERNODE_ENABLED; // OK
 }
@@ -543,7 +591,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     if (pmn->pubKeyCollateralAddress == pubKeyCollateralAddress && !pmn->IsBroadcastedWithin(MASTERNODE_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrintf("mnb - Got updated entry for %s\n", addr.ToString());
-        if (pmn->UpdateFromNewBroadcast((*this))) {
+        if (mnodeman.UpdateFromNewBroadcast(*pmn, *this)) {
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
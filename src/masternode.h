@@ -14,6 +14,7 @@
 #include "sync.h"
 #include "timedata.h"
 #include "util.h"
+#include "validationinterface.h"
 
 #define MASTERNODE_MIN_CONFIRMATIONS 5 // TODO CHANGE DEMO
 #define MASTERNODE_MIN_MNP_SECONDS (10 * 60)
@@ -29,9 +30,40 @@ using namespace std;
 class CMasternode;
 class CMasternodeBroadcast;
 class CMasternodePing;
-extern map<int64_t, uint256> mapCacheBlockHashes;
+class CMasternodeCollateral;
+
+extern CMasternodeCollateral masternodeCollateral;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
+/** Number of times the active state of any Masternode has changed, for caches of results that depend on it */
+int64_t GetMasternodeStateChanges();
+
+/** Spent status of Masternode collateral outputs. An output is read from the
+ *  coins view once and remembered as unspent until a transaction touching it
+ *  is announced, so repeated Masternode checks rarely need cs_main.
+ */
+class CMasternodeCollateral : public CValidationInterface
+{
+private:
+    mutable CCriticalSection cs;
+    // value of collateral outputs known to be unspent in the chain tip and the mempool
+    std::map<COutPoint, CAmount> mapUnspent;
+
+protected:
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
+public:
+    enum Status {
+        COLLATERAL_UNSPENT,
+        COLLATERAL_SPENT,
+        COLLATERAL_BUSY // cs_main was taken, try again later
+    };
+
+    /// Look up a collateral output, never blocking on cs_main
+    Status GetStatus(const COutPoint& outpoint, CAmount& nValueRet);
+
+    void Clear();
+};
 
 //
 // The Masternode Ping Class : Contains a different serialize method for sending pings from masternodes throughout the network
@@ -111,6 +143,9 @@ private:
     mutable CCriticalSection cs;
     int64_t lastTimeChecked;
 
+    /// Re-evaluate activeState, called by Check
+    void UpdateActiveState();
+
 public:
     enum state {
         MASTERNODE_PRE_ENABLED,
@@ -34,14 +34,6 @@ struct CompareScoreTxIn {
     }
 };
 
-struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 //
 // CMasternodeDB
 //
@@ -236,12 +228,35 @@ bool CMasternodeMan::Add(CMasternode& mn)
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.addr.ToString(), size() + 1);
         vMasternodes.push_back(mn);
+        IndexMasternode(vMasternodes.size() - 1);
+        mapRankTables.clear();
         return true;
     }
 
     return false;
 }
 
+void CMasternodeMan::IndexMasternode(size_t nIndex)
+{
+    const CMasternode& mn = vMasternodes[nIndex];
+
+    // first entry wins on duplicate keys, same as the old linear scans
+    mapIndexByVin.insert(make_pair(mn.vin.prevout, nIndex));
+    mapIndexByPayee.insert(make_pair(GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()), nIndex));
+    mapIndexByPubKey.insert(make_pair(mn.pubKeyMasternode, nIndex));
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    LOCK(cs);
+
+    mapIndexByVin.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
+    for (size_t i = 0; i < vMasternodes.size(); i++)
+        IndexMasternode(i);
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
@@ -274,6 +289,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
+    bool fRemoved = false;
     vector<CMasternode>::iterator it = vMasternodes.begin();
     while (it != vMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
@@ -306,11 +322,17 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             it = vMasternodes.erase(it);
+            fRemoved = true;
         } else {
             ++it;
         }
     }
 
+    if (fRemoved) {
+        RebuildIndexes();
+        mapRankTables.clear();
+    }
+
     // check who's asked for the Masternode list
     map<CNetAddr, int64_t>::iterator it1 = mAskedUsForMasternodeList.begin();
     while (it1 != mAskedUsForMasternodeList.end()) {
@@ -367,6 +389,10 @@ void CMasternodeMan::Clear()
 {
     LOCK(cs);
     vMasternodes.clear();
+    mapIndexByVin.clear();
+    mapIndexByPayee.clear();
+    mapIndexByPubKey.clear();
+    mapRankTables.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -412,25 +438,21 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<CScript, size_t, MasternodeIndexHasher>::const_iterator it = mapIndexByPayee.find(payee);
+    if (it == mapIndexByPayee.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, size_t, MasternodeIndexHasher>::const_iterator it = mapIndexByVin.find(vin.prevout);
+    if (it == mapIndexByVin.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 
 
@@ -438,11 +460,10 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<CPubKey, size_t, MasternodeIndexHasher>::const_iterator it = mapIndexByPubKey.find(pubKeyMasternode);
+    if (it == mapIndexByPubKey.end())
+        return NULL;
+    return &vMasternodes[it->second];
 }
 // TODO
 
@@ -591,36 +612,44 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeMan::CMasternodeRankTable& CMasternodeMan::GetRankTable(int64_t nBlockHeight, const uint256& hashBlock, int minProtocol, int nFlags)
 {
+    AssertLockHeld(cs);
+
+    // Masternode states only move on every MASTERNODE_CHECK_SECONDS, so a table
+    // that recent is as good as a fresh scan of the list
+    RankTableKey key = make_pair(nBlockHeight, make_pair(minProtocol, nFlags));
+    std::map<RankTableKey, CMasternodeRankTable>::iterator it = mapRankTables.find(key);
+    if (it != mapRankTables.end()) {
+        if (it->second.hashBlock == hashBlock && it->second.nStateChanges == GetMasternodeStateChanges() &&
+            GetTime() - it->second.nTimeBuilt < MASTERNODE_CHECK_SECONDS)
+            return it->second;
+        mapRankTables.erase(it);
+    }
+
     std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
-    int64_t nMasternode_Age = 0;
- 
- 
-
-    //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    bool fMinAge = (nFlags & RANK_MIN_AGE) && IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT);
 
-    // scan for winner
     BOOST_FOREACH (CMasternode& mn, vMasternodes) {
         if (mn.protocolVersion < minProtocol) {
-            LogPrintf("Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
-            continue;                                                       // Skip obsolete versions
+            LogPrint("masternode", "Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
+            continue; // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
-            nMasternode_Age = mn.lastPing.sigTime - mn.sigTime;
-            if ((nMasternode_Age) < nMasternode_Min_Age) {
-                LogPrintf("Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
-                continue;                                                   // Skip masternodes younger than (default) 1 hour
+        if (fMinAge) {
+            int64_t nMasternode_Age = mn.lastPing.sigTime - mn.sigTime;
+            if (nMasternode_Age < nMasternode_Min_Age) {
+                LogPrint("masternode", "Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
+                continue; // Skip masternodes younger than (default) 1 hour
             }
-}
-        if (fOnlyActive) {
+        }
+
+        if (nFlags & RANK_ONLY_ACTIVE) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
+
         uint256 n = mn.CalculateScore(1, nBlockHeight);
         int64_t n2 = n.GetCompact(false);
 
@@ -629,47 +658,61 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
+    // keep the tables of the most recent heights
+    if (mapRankTables.size() >= MASTERNODE_RANK_TABLES)
+        mapRankTables.erase(mapRankTables.begin());
+
+    CMasternodeRankTable& table = mapRankTables[key];
+    table.nTimeBuilt = GetTime();
+    // read after the scan, whose Check() calls may have changed states
+    table.nStateChanges = GetMasternodeStateChanges();
+    table.hashBlock = hashBlock;
+    table.vecRanked.reserve(vecMasternodeScores.size());
+
     int rank = 0;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        table.vecRanked.push_back(s.second);
+        table.mapRank.insert(make_pair(s.second.prevout, rank));
     }
 
-    return -1;
+    return table;
+}
+
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    //make sure we know about this block
+    uint256 hash = 0;
+    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+
+    LOCK(cs);
+
+    const CMasternodeRankTable& table = GetRankTable(nBlockHeight, hash, minProtocol, RANK_MIN_AGE | (fOnlyActive ? RANK_ONLY_ACTIVE : 0));
+    std::map<COutPoint, int>::const_iterator it = table.mapRank.find(vin.prevout);
+    if (it == table.mapRank.end())
+        return -1;
+
+    return it->second;
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
     //make sure we know about this block
     uint256 hash = 0;
     if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        mn.Check();
-
-        if (mn.protocolVersion < minProtocol) continue;
-        if (!mn.IsEnabled()) {
-            continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
-    }
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
+    const CMasternodeRankTable& table = GetRankTable(nBlockHeight, hash, minProtocol, RANK_ONLY_ACTIVE);
+    vecMasternodeRanks.reserve(table.vecRanked.size());
 
     int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (const CTxIn& vin, table.vecRanked) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        CMasternode* pmn = Find(vin);
+        if (pmn) vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -677,33 +720,19 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    // an unknown block gives every Masternode a zero score and the list is
+    // ranked as it stands, as it always was; the table is keyed to the zero
+    // hash, so it is rebuilt once the block is known
+    uint256 hash = 0;
+    GetBlockHash(hash, nBlockHeight);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    LOCK(cs);
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+    const CMasternodeRankTable& table = GetRankTable(nBlockHeight, hash, minProtocol, fOnlyActive ? RANK_ONLY_ACTIVE : 0);
+    if (nRank < 1 || nRank > (int)table.vecRanked.size())
+        return NULL;
 
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
-
-    return NULL;
+    return Find(table.vecRanked[nRank - 1]);
 }
 
 void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
@@ -844,6 +873,8 @@ void CMasternodeMan::Remove(CTxIn vin)
         if ((*it).vin == vin) {
             LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).addr.ToString(), size() - 1);
             vMasternodes.erase(it);
+            RebuildIndexes();
+            mapRankTables.clear();
             break;
         }
         ++it;
@@ -864,11 +895,27 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         if (Add(mn)) {
             masternodeSync.AddedMasternodeList(mnb.GetHash());
         }
-    } else if (pmn->UpdateFromNewBroadcast(mnb)) {
+    } else if (UpdateFromNewBroadcast(*pmn, mnb)) {
         masternodeSync.AddedMasternodeList(mnb.GetHash());
     }
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+
+    CPubKey pubKeyCollateralAddressPrev = mn.pubKeyCollateralAddress;
+    CPubKey pubKeyMasternodePrev = mn.pubKeyMasternode;
+    if (!mn.UpdateFromNewBroadcast(mnb))
+        return false;
+
+    // re-keyed Masternodes are rare, a full rebuild keeps duplicate keys resolved in list order
+    if (mn.pubKeyCollateralAddress != pubKeyCollateralAddressPrev || mn.pubKeyMasternode != pubKeyMasternodePrev)
+        RebuildIndexes();
+    mapRankTables.clear();
+    return true;
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
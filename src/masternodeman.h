@@ -15,13 +15,23 @@
 #include "sync.h"
 #include "util.h"
 
+#include <boost/functional/hash.hpp>
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODE_RANK_TABLES 32
 
 using namespace std;
 
 class CMasternodeMan;
 
+struct MasternodeIndexHasher {
+    size_t operator()(const COutPoint& outpoint) const { return outpoint.hash.GetLow64() ^ outpoint.n; }
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+    size_t operator()(const CPubKey& pubkey) const { return boost::hash_range(pubkey.begin(), pubkey.end()); }
+};
+
 extern CMasternodeMan mnodeman;
 void DumpMasternodes();
 
@@ -60,6 +70,10 @@ private:
 
     // map to hold all MNs
     std::vector<CMasternode> vMasternodes;
+    // positions in vMasternodes by collateral outpoint, payee script and masternode pubkey
+    boost::unordered_map<COutPoint, size_t, MasternodeIndexHasher> mapIndexByVin;
+    boost::unordered_map<CScript, size_t, MasternodeIndexHasher> mapIndexByPayee;
+    boost::unordered_map<CPubKey, size_t, MasternodeIndexHasher> mapIndexByPubKey;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -67,6 +81,32 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    enum {
+        RANK_ONLY_ACTIVE = 1, // skip Masternodes that are not enabled
+        RANK_MIN_AGE = 2      // skip Masternodes younger than SPORK_16_MN_WINNER_MINIMUM_AGE
+    };
+
+    /** Masternodes of one block height ordered by score, best first */
+    struct CMasternodeRankTable {
+        int64_t nTimeBuilt;
+        int64_t nStateChanges; // GetMasternodeStateChanges() when built
+        uint256 hashBlock;
+        std::vector<CTxIn> vecRanked;
+        std::map<COutPoint, int> mapRank;
+    };
+
+    // rank tables by (block height, (min protocol, RANK_* flags)), dropped whenever the list or a Masternode's state changes
+    typedef std::pair<int64_t, std::pair<int, int> > RankTableKey;
+    std::map<RankTableKey, CMasternodeRankTable> mapRankTables;
+
+    /// Add the entry at position nIndex of vMasternodes to the lookup indexes
+    void IndexMasternode(size_t nIndex);
+    /// Recreate the lookup indexes after entries were moved or their keys changed
+    void RebuildIndexes();
+
+    /// Return the cached rank table, rebuilding it if it is missing, stale, for another block or older than a state change
+    const CMasternodeRankTable& GetRankTable(int64_t nBlockHeight, const uint256& hashBlock, int minProtocol, int nFlags);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -79,7 +119,11 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        if (ser_action.ForRead())
+            mapRankTables.clear();
         READWRITE(vMasternodes);
+        if (ser_action.ForRead())
+            RebuildIndexes();
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -150,6 +194,9 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Apply a newer broadcast to a listed Masternode, keeping the lookup indexes in step
+    bool UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb);
 };
 
 #endif
@@ -24,8 +24,9 @@
 #endif
 #include "masternode-payments.h"
 
+#include <limits>
+
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 
 using namespace std;
 
@@ -34,53 +35,361 @@ using namespace std;
 // CCMiner
 //
 
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
 //
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// Transactions are selected as packages: a mempool transaction together with
+// those of its in-mempool ancestors that are not in the block yet, ranked by
+// the modified fee rate of the whole package. The mempool keeps its entries
+// ordered that way (the ancestor_score index). Once a package is in the block,
+// its descendants' packages shrink; the mempool entries must not change, so
+// the reduced packages are tracked in an indexed_modified_transaction_set for
+// the rest of the assembly.
 //
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+struct CTxMemPoolModifiedEntry {
+    CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
+    {
+        iter = entry;
+        nSizeWithAncestors = entry->GetSizeWithAncestors();
+        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
+    }
+
+    CTxMemPool::txiter iter;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+};
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+/** Comparator for CTxMemPool::txiter objects, by address of the entry */
+struct CompareCTxMemPoolIter {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
+        return &(*a) < &(*b);
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
+struct modifiedentry_iter {
+    typedef CTxMemPool::txiter result_type;
+    result_type operator()(const CTxMemPoolModifiedEntry& entry) const
+    {
+        return entry.iter;
+    }
+};
+
+/** The order of CompareTxMemPoolEntryByAncestorFee, for the reduced packages */
+struct CompareModifiedEntry {
+    bool operator()(const CTxMemPoolModifiedEntry& a, const CTxMemPoolModifiedEntry& b) const
+    {
+        double f1 = (double)a.nModFeesWithAncestors * b.nSizeWithAncestors;
+        double f2 = (double)b.nModFeesWithAncestors * a.nSizeWithAncestors;
+        if (f1 == f2)
+            return CTxMemPool::CompareIteratorByHash()(a.iter, b.iter);
+        return f1 > f2;
+    }
+};
+
+/** Parents before children: a transaction has more in-mempool ancestors than any of its ancestors */
+struct CompareTxIterByAncestorCount {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
+            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+        return CTxMemPool::CompareIteratorByHash()(a, b);
+    }
+};
+
+typedef boost::multi_index_container<
+    CTxMemPoolModifiedEntry,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            modifiedentry_iter,
+            CompareCTxMemPoolIter>,
+        // sorted by modified ancestor fee rate
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
+            CompareModifiedEntry> > >
+    indexed_modified_transaction_set;
+
+typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
+typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
+
+struct update_for_parent_inclusion {
+    update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
+
+    void operator()(CTxMemPoolModifiedEntry& e)
+    {
+        e.nModFeesWithAncestors -= iter->GetModifiedFee();
+        e.nSizeWithAncestors -= iter->GetTxSize();
+    }
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+    CTxMemPool::txiter iter;
+};
+
+// Coin age priority changes with the height, so it cannot be kept in a mempool index
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+struct TxCoinAgePriorityCompare {
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
+    {
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second); // Reverse order to make sort less than
+        return a.first < b.first;
+    }
+};
+
+/**
+ * Picks the transactions of a new block from the mempool, checking each of
+ * them against the block so far. cs_main and mempool.cs must be held while
+ * it is used.
+ */
+class CBlockTxSelector
 {
-    bool byFee;
+private:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    const int nHeight;
+    const unsigned int nBlockMaxSize;
+    const unsigned int nBlockMinSize;
+    const bool fPrintPriority;
+
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries failedTx;
+    indexed_modified_transaction_set mapModifiedTx;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) {}
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    unsigned int nBlockSigOps;
+    CAmount nFees;
+
+    CBlockTxSelector(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn, unsigned int nBlockMinSizeIn)
+        : pblocktemplate(pblocktemplateIn), view(viewIn), nHeight(nHeightIn), nBlockMaxSize(nBlockMaxSizeIn), nBlockMinSize(nBlockMinSizeIn),
+          fPrintPriority(GetBoolArg("-printpriority", false)), nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0)
+    {
+    }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    /** Fill the first nBlockPrioritySize bytes with transactions by coin age priority, regardless of fee */
+    void AddPriorityTxs(unsigned int nBlockPrioritySize);
+    /** Add packages by modified fee rate until the block is full, or the rest would not pay the relay fee */
+    void AddPackageTxs();
+
+private:
+    /** Check transactions, parents first, against the block so far, and add them all if they pass */
+    bool TestAndAddTxs(const std::vector<CTxMemPool::txiter>& vEntries);
+    /** Shrink the packages of the descendants of transactions just added */
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded);
+    bool SkipMapTxEntry(CTxMemPool::txiter it)
     {
-        if (byFee) {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+        return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
+    }
+};
+
+bool CBlockTxSelector::TestAndAddTxs(const std::vector<CTxMemPool::txiter>& vEntries)
+{
+    CCoinsViewCache viewPackage(&view);
+    std::vector<CAmount> vTxFees;
+    std::vector<unsigned int> vTxSigOps;
+    unsigned int nPackageSigOps = 0;
+    BOOST_FOREACH (CTxMemPool::txiter it, vEntries) {
+        const CTransaction& tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            return false;
+
+        if (!viewPackage.HaveInputs(tx))
+            return false;
+
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        CAmount nTxFees = viewPackage.GetValueIn(tx) - tx.GetValueOut();
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, nHeight);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+
+    for (unsigned int i = 0; i < vEntries.size(); i++) {
+        CTxMemPool::txiter it = vEntries[i];
+        pblocktemplate->block.vtx.push_back(it->GetTx());
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += it->GetTxSize();
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        inBlock.insert(it);
+        mapModifiedTx.erase(it);
+
+        if (fPrintPriority) {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                it->GetPriority(nHeight), CFeeRate(it->GetModifiedFee(), it->GetTxSize()).ToString(), it->GetTx().GetHash().ToString());
+        }
+    }
+    return true;
+}
+
+void CBlockTxSelector::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded)
+{
+    BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
+        CTxMemPool::setEntries descendants;
+        mempool.CalculateDescendants(it, descendants);
+        BOOST_FOREACH (CTxMemPool::txiter desc, descendants) {
+            if (alreadyAdded.count(desc))
+                continue;
+            modtxiter mit = mapModifiedTx.find(desc);
+            if (mit == mapModifiedTx.end()) {
+                CTxMemPoolModifiedEntry modEntry(desc);
+                modEntry.nSizeWithAncestors -= it->GetTxSize();
+                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
+                mapModifiedTx.insert(modEntry);
+            } else {
+                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
+            }
+        }
+    }
+}
+
+void CBlockTxSelector::AddPriorityTxs(unsigned int nBlockPrioritySize)
+{
+    if (nBlockPrioritySize == 0)
+        return;
+
+    // Only the values cached in the entries are needed, no coin lookups
+    std::vector<TxCoinAgePriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi) {
+        double dPriority = mi->GetPriority(nHeight);
+        CAmount dummy;
+        mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+        vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+    }
+
+    TxCoinAgePriorityCompare comparer;
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+    while (!vecPriority.empty()) {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().first;
+        CTxMemPool::txiter iter = vecPriority.front().second;
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (nBlockSize + iter->GetTxSize() >= nBlockPrioritySize || !AllowFree(dPriority))
+            return;
+
+        // Transactions that spend unconfirmed outputs are left to the fee
+        // rate pass unless their parents already made it into the block
+        bool fParentsInBlock = true;
+        BOOST_FOREACH (CTxMemPool::txiter parent, mempool.GetMemPoolParents(iter)) {
+            if (!inBlock.count(parent)) {
+                fParentsInBlock = false;
+                break;
+            }
+        }
+        if (!fParentsInBlock || inBlock.count(iter))
+            continue;
+
+        std::vector<CTxMemPool::txiter> vEntries(1, iter);
+        if (TestAndAddTxs(vEntries)) {
+            CTxMemPool::setEntries added;
+            added.insert(iter);
+            UpdatePackagesForAdded(added);
+        }
+    }
+}
+
+void CBlockTxSelector::AddPackageTxs()
+{
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    CTxMemPool::txiter iter;
+    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
+        // First try to find a new transaction in mapTx to evaluate.
+        if (mi != mempool.mapTx.get<ancestor_score>().end() && SkipMapTxEntry(mempool.mapTx.project<0>(mi))) {
+            ++mi;
+            continue;
+        }
+
+        // Now that mi is not stale, determine which transaction to evaluate:
+        // the next entry from mapTx, or the best from mapModifiedTx?
+        bool fUsingModified = false;
+        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
+        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
+            // We're out of entries in mapTx; use the entry from mapModifiedTx
+            iter = modit->iter;
+            fUsingModified = true;
         } else {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            iter = mempool.mapTx.project<0>(mi);
+            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
+                CompareModifiedEntry()(*modit, CTxMemPoolModifiedEntry(iter))) {
+                // The best entry in mapModifiedTx has higher score
+                // than the one from mapTx
+                iter = modit->iter;
+                fUsingModified = true;
+            } else {
+                // Either no entry in mapModifiedTx, or it's worse than mapTx.
+                ++mi;
+            }
+        }
+
+        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
+        // contain anything that is inBlock.
+        assert(!inBlock.count(iter));
+
+        uint64_t nPackageSize = iter->GetSizeWithAncestors();
+        CAmount nPackageFees = iter->GetModFeesWithAncestors();
+        if (fUsingModified) {
+            nPackageSize = modit->nSizeWithAncestors;
+            nPackageFees = modit->nModFeesWithAncestors;
+        }
+
+        // Skip free transactions if we're past the minimum block size; all
+        // packages still to come pay an even lower fee rate
+        if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize) && nBlockSize >= nBlockMinSize)
+            return;
+
+        bool fPackageOk = false;
+        if (nBlockSize + nPackageSize < nBlockMaxSize) {
+            CTxMemPool::setEntries ancestors;
+            std::string dummy;
+            mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            for (CTxMemPool::setEntries::iterator ait = ancestors.begin(); ait != ancestors.end();) {
+                if (inBlock.count(*ait))
+                    ancestors.erase(ait++);
+                else
+                    ++ait;
+            }
+            ancestors.insert(iter);
+
+            std::vector<CTxMemPool::txiter> vSorted(ancestors.begin(), ancestors.end());
+            std::sort(vSorted.begin(), vSorted.end(), CompareTxIterByAncestorCount());
+            fPackageOk = TestAndAddTxs(vSorted);
+            if (fPackageOk)
+                UpdatePackagesForAdded(ancestors);
+        }
+
+        if (!fPackageOk && fUsingModified) {
+            // Since we always look at the best entry in mapModifiedTx,
+            // we must erase failed entries so that we can consider the
+            // next best entry on the next loop iteration
+            mapModifiedTx.get<ancestor_score>().erase(modit);
+            failedTx.insert(iter);
         }
     }
-};
+}
 
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
@@ -167,169 +476,13 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi) {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash)) {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash)) {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
-        }
-
         // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty()) {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            if (!view.HaveInputs(tx))
-                continue;
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
-
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+        CBlockTxSelector selector(pblocktemplate.get(), view, nHeight, nBlockMaxSize, nBlockMinSize);
+        selector.AddPriorityTxs(nBlockPrioritySize);
+        selector.AddPackageTxs();
+        uint64_t nBlockSize = selector.nBlockSize;
+        uint64_t nBlockTx = selector.nBlockTx;
+        nFees = selector.nFees;
 
         //handle premine here
         auto vDevReward = 50 * COIN;
@@ -5,6 +5,7 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -76,16 +77,19 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if ((nSize & 1) == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
         }
+
+        // Sibling pairs are adjacent in memory, so the whole level is hashed as
+        // a run of 64-byte nodes. An odd last node is paired with itself.
+        int nPairs = nSize / 2;
+        vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+        if (nSize & 1)
+            vMerkleTree[j+nSize+nPairs] = Hash(BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]),
+                                               BEGIN(vMerkleTree[j+nSize-1]), END(vMerkleTree[j+nSize-1]));
         j += nSize;
     }
     if (fMutated) {
@@ -156,6 +160,8 @@ void CBlock::print() const
 // ppcoin: sign block
 bool CBlock::SignBlock(const CKeyStore& keystore)
 {
+    fSignatureChecked = false;
+
     std::vector<valtype> vSolutions;
     txnouttype whichType;
 
@@ -232,6 +238,10 @@ bool CBlock::SignBlock(const CKeyStore& keystore)
 
 bool CBlock::CheckBlockSignature() const
 {
+    // only the expensive positive result is remembered
+    if (fSignatureChecked)
+        return true;
+
     if (IsProofOfWork())
         return vchBlockSig.empty();
 
@@ -253,7 +263,7 @@ bool CBlock::CheckBlockSignature() const
         if (vchBlockSig.empty())
             return false;
 
-        return pubkey.Verify(GetHash(), vchBlockSig);
+        return fSignatureChecked = pubkey.Verify(GetHash(), vchBlockSig);
     }
     else if(whichType == TX_PUBKEYHASH)
     {
@@ -268,7 +278,7 @@ bool CBlock::CheckBlockSignature() const
         if (vchBlockSig.empty())
             return false;
 
-        return pubkey.Verify(GetHash(), vchBlockSig);
+        return fSignatureChecked = pubkey.Verify(GetHash(), vchBlockSig);
 
     }
 
@@ -70,6 +70,12 @@ public:
 
     uint256 GetHash() const;
 
+    uint256 GetPoWHash() const
+    {
+        uint256 thash;
+        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
+        return thash;
+    }
 
     int64_t GetBlockTime() const
     {
@@ -93,6 +99,8 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    mutable bool fChecked;          // CheckBlock passed with every check enabled
+    mutable bool fSignatureChecked; // CheckBlockSignature passed
 
     CBlock()
     {
@@ -109,6 +117,11 @@ public:
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        if (ser_action.ForRead()) {
+            // new contents, nothing about them has been checked yet
+            fChecked = false;
+            fSignatureChecked = false;
+        }
         READWRITE(*(CBlockHeader*)this);
         READWRITE(vtx);
 	    if(vtx.size() > 1 && vtx[1].IsCoinStake()) {
@@ -126,14 +139,8 @@ public:
         vMerkleTree.clear();
         payee = CScript();
         vchBlockSig.clear();
-    }
-
-
-    uint256 GetPoWHash() const
-    {
-        uint256 thash;
-        scrypt_1024_1_1_256(BEGIN(nVersion), BEGIN(thash));
-        return thash;
+        fChecked = false;
+        fSignatureChecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
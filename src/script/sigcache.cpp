@@ -5,13 +5,14 @@
 
 #include "sigcache.h"
 
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
+#include "serialize.h"
 #include "uint256.h"
 #include "util.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 namespace {
 
@@ -19,56 +20,100 @@ namespace {
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are salted hashes of (signature hash, public key, signature) kept in
+ * fixed size set-associative buckets. The buckets are split over independently
+ * locked shards so the script check threads rarely wait on each other.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const unsigned int SHARDS = 16;
+    static const unsigned int WAYS = 4;
+
+    struct CShard {
+        boost::shared_mutex cs;
+        //! WAYS slots per bucket, null when unused
+        std::vector<uint256> vSlots;
+    };
+
+    //! Per process salt so nobody can predict bucket placement or eviction
+    uint256 nonce;
+    size_t nBuckets;
+    CShard shards[SHARDS];
+
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        // the public key encodes its own length, so pubkey | signature is unambiguous
+        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(pubKey.begin(), pubKey.size()).Write(begin_ptr(vchSig), vchSig.size()).Finalize(entry.begin());
+    }
+
+    CShard& GetShard(const uint256& entry, size_t& nFirstSlot)
+    {
+        uint64_t nBits = entry.GetLow64();
+        nFirstSlot = ((nBits / SHARDS) % nBuckets) * WAYS;
+        return shards[nBits % SHARDS];
+    }
 
 public:
+    CSignatureCache() : nBuckets(0)
+    {
+        nonce = GetRandHash();
+
+        // -maxsigcachesize counts entries, rounded down to whole buckets
+        int64_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE);
+        nBuckets = (size_t)nMaxCacheSize / (WAYS * SHARDS);
+        for (unsigned int i = 0; i < SHARDS; i++)
+            shards[i].vSlots.resize(nBuckets * WAYS);
+        LogPrintf("Using %.1f MiB for signature cache, able to store %u elements\n",
+            (nBuckets * WAYS * SHARDS * sizeof(uint256)) * (1.0 / (1 << 20)), nBuckets * WAYS * SHARDS);
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        if (nBuckets == 0) return false;
+
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+
+        size_t nFirstSlot;
+        CShard& shard = GetShard(entry, nFirstSlot);
+        boost::shared_lock<boost::shared_mutex> lock(shard.cs);
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        for (size_t i = nFirstSlot; i < nFirstSlot + WAYS; i++) {
+            if (shard.vSlots[i] == entry)
+                return true;
+        }
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (nBuckets == 0) return;
+
+        uint256 entry;
+        ComputeEntry(entry, hash, vchSig, pubKey);
+
+        size_t nFirstSlot;
+        CShard& shard = GetShard(entry, nFirstSlot);
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+
+        size_t nFree = nFirstSlot + WAYS;
+        for (size_t i = nFirstSlot; i < nFirstSlot + WAYS; i++) {
+            if (shard.vSlots[i] == entry)
+                return;
+            if (nFree == nFirstSlot + WAYS && shard.vSlots[i] == 0)
+                nFree = i;
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // When the bucket is full evict an entry picked by the salted hash. The
+        // choice is unpredictable, which foils would-be DoS attackers who might
+        // try to pre-generate and re-use a set of valid signatures just-slightly-greater
+        // than our cache size.
+        if (nFree == nFirstSlot + WAYS)
+            nFree = nFirstSlot + entry.begin()[31] % WAYS;
+        shard.vSlots[nFree] = entry;
     }
 };
 
@@ -10,6 +10,13 @@
 
 #include <vector>
 
+// DoS prevention: limit cache size to 32MB (32 bytes per entry, over a million
+// entries). Since there are a maximum of 20,000 signature operations per block
+// that comfortably holds everything the mempool validated.
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 1 << 20;
+// Maximum sig cache size allowed, in entries (16 GiB)
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = (int64_t)1 << 29;
+
 class CPubKey;
 
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
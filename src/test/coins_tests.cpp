@@ -4,7 +4,9 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "utiltime.h"
 
 #include <vector>
 #include <map>
@@ -58,6 +60,98 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true, true) {}
+
+    // Write a record in the layout from before CCoinsViewDB::Upgrade
+    void WriteOldCoins(const uint256& txid, const CCoins& coins)
+    {
+        db.Write(std::make_pair('c', txid), coins);
+    }
+
+    bool HaveOldCoins(const uint256& txid)
+    {
+        return db.Exists(std::make_pair('c', txid));
+    }
+
+    // Write the best block the way versions from before the upgrade do
+    void WriteOldBestBlock(const uint256& hash)
+    {
+        db.Write('B', hash);
+    }
+
+    void WriteVersion(int nVersion)
+    {
+        db.Write('V', nVersion);
+    }
+};
+
+// Fails every write once fFail is set, and counts the failures instead of
+// aborting the node
+class CCoinsViewDBFailing : public CCoinsViewDBTest
+{
+public:
+    bool fFail;
+    int nErrors; // written by the writer thread, read after StopWriter
+
+    CCoinsViewDBFailing() : fFail(false), nErrors(0) {}
+    ~CCoinsViewDBFailing() { StopWriter(); } // while the overrides still exist
+
+protected:
+    bool WriteToDisk(CLevelDBBatch& batch) { return !fFail && CCoinsViewDBTest::WriteToDisk(batch); }
+    void OnWriteError() { nErrors++; }
+};
+
+// Takes a while for every write, and counts the writes that are done
+class CCoinsViewDBSlow : public CCoinsViewDBTest
+{
+public:
+    int nWrites; // written by the writer thread, read after Sync
+
+    CCoinsViewDBSlow() : nWrites(0) {}
+    ~CCoinsViewDBSlow() { StopWriter(); }
+
+protected:
+    bool WriteToDisk(CLevelDBBatch& batch)
+    {
+        MilliSleep(200);
+        bool fOk = CCoinsViewDBTest::WriteToDisk(batch);
+        nWrites++;
+        return fOk;
+    }
+};
+
+CCoins RandomCoins(unsigned int nOutputs, int nHeight)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = nHeight;
+    coins.vout.resize(nOutputs);
+    for (unsigned int n = 0; n < nOutputs; n++) {
+        coins.vout[n].nValue = insecure_rand();
+        coins.vout[n].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+    }
+    return coins;
+}
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -89,8 +183,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -113,8 +207,11 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     updated_an_entry = true;
                 }
                 coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
+                coins.vout.resize(1 + insecure_rand() % 4);
+                for (unsigned int n = 0; n < coins.vout.size(); n++) {
+                    coins.vout[n].nValue = insecure_rand();
+                    coins.vout[n].scriptPubKey.resize(insecure_rand() % 64);
+                }
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,6 +232,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +251,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +275,259 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Round trip of transactions through the per output records of CCoinsViewDB,
+// starting from the per transaction layout it upgrades from
+BOOST_AUTO_TEST_CASE(coins_db_test)
+{
+    CCoinsViewDBTest db;
+
+    uint256 txidA = GetRandHash();
+    CCoins coinsA = RandomCoins(3, 100);
+    coinsA.Spend(1);
+    uint256 txidB = GetRandHash();
+    CCoins coinsB = RandomCoins(1, 101);
+    coinsB.fCoinBase = true;
+    db.WriteOldCoins(txidA, coinsA);
+    db.WriteOldCoins(txidB, coinsB);
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(!db.HaveOldCoins(txidA));
+    BOOST_CHECK(!db.HaveOldCoins(txidB));
+    BOOST_CHECK(db.Upgrade());
+
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txidA, coins));
+    BOOST_CHECK(coins == coinsA);
+    BOOST_CHECK(db.GetCoins(txidB, coins));
+    BOOST_CHECK(coins == coinsB);
+    BOOST_CHECK(!db.HaveCoins(GetRandHash()));
+
+    // Spend an output and add a transaction
+    uint256 txidC = GetRandHash();
+    CCoins coinsC = RandomCoins(2, 102);
+    coinsC.fCoinStake = true;
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txidA)->Spend(0);
+        *cache.ModifyCoins(txidC) = coinsC;
+        BOOST_CHECK(cache.Flush());
+    }
+    coinsA.Spend(0);
+    BOOST_CHECK(db.GetCoins(txidA, coins));
+    BOOST_CHECK(coins == coinsA);
+    BOOST_CHECK(db.GetCoins(txidC, coins));
+    BOOST_CHECK(coins == coinsC);
+
+    // Spending the last output removes the transaction
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txidA)->Spend(2);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetCoins(txidA, coins));
+    BOOST_CHECK(!db.HaveCoins(txidA));
+
+    // Spending an output and restoring it, as disconnecting a block does,
+    // through a stack of two caches
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsViewCache child(&cache);
+            child.ModifyCoins(txidC)->Spend(0);
+            BOOST_CHECK(child.Flush());
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txidC)->vout[0] = coinsC.vout[0];
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetCoins(txidC, coins));
+    BOOST_CHECK(coins == coinsC);
+
+    // A transaction disconnected and connected again at another height, as
+    // a reorg does, with its outputs added back through ModifyNewCoins
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsViewCache child(&cache);
+            child.ModifyCoins(txidC)->Clear();
+            BOOST_CHECK(child.Flush());
+        }
+        {
+            CCoinsViewCache child(&cache);
+            coinsC.nHeight = 103;
+            *child.ModifyNewCoins(txidC) = coinsC;
+            BOOST_CHECK(child.Flush());
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetCoins(txidC, coins));
+    BOOST_CHECK(coins == coinsC);
+
+    // New outputs spent before they reach the database leave nothing behind
+    uint256 txidD = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyNewCoins(txidD) = RandomCoins(1, 104);
+        cache.ModifyCoins(txidD)->Spend(0);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(txidD));
+}
+
+// The upgrade marks the chainstate and moves its best block, so that older
+// versions do not load it, and a chainstate they wrote to afterwards is
+// refused instead of being read with stale records
+BOOST_AUTO_TEST_CASE(coins_db_version_test)
+{
+    CCoinsViewDBTest db;
+
+    uint256 txid = GetRandHash();
+    CCoins coinsOld = RandomCoins(2, 100);
+    uint256 hashBlock = GetRandHash();
+    db.WriteOldCoins(txid, coinsOld);
+    db.WriteOldBestBlock(hashBlock);
+    BOOST_CHECK(db.CheckVersion());
+    BOOST_CHECK(db.GetBestBlock() == 0);
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.CheckVersion());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsOld);
+
+    // Upgrading again changes nothing
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.CheckVersion());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+
+    // An older version rebuilt its own chainstate next to the converted one
+    db.WriteOldBestBlock(GetRandHash());
+    BOOST_CHECK(!db.CheckVersion());
+
+    // A layout from a newer version
+    CCoinsViewDBTest dbNewer;
+    dbNewer.WriteVersion(1000);
+    BOOST_CHECK(!dbNewer.CheckVersion());
+
+    // A new chainstate gets the marker too
+    CCoinsViewDBTest dbNew;
+    BOOST_CHECK(dbNew.Upgrade());
+    dbNew.WriteOldBestBlock(GetRandHash());
+    BOOST_CHECK(!dbNew.CheckVersion());
+}
+
+// With the background writer, flushed coins and the best block can be read
+// back at once, and are in the database after Sync
+BOOST_AUTO_TEST_CASE(coins_db_writer_test)
+{
+    CCoinsViewDBTest db;
+    db.StartWriter();
+
+    std::vector<uint256> vTxid;
+    std::vector<CCoins> vCoins;
+    for (int nFlush = 0; nFlush < 10; nFlush++) {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++) {
+            vTxid.push_back(GetRandHash());
+            vCoins.push_back(RandomCoins(1 + insecure_rand() % 4, nFlush));
+            *cache.ModifyCoins(vTxid.back()) = vCoins.back();
+        }
+        // Spend one output of a transaction from an earlier flush
+        if (nFlush > 0) {
+            size_t i = insecure_rand() % (vTxid.size() - 100);
+            if (!vCoins[i].IsPruned()) {
+                cache.ModifyCoins(vTxid[i])->Spend(vCoins[i].vout.size() - 1);
+                vCoins[i].Spend(vCoins[i].vout.size() - 1);
+            }
+        }
+        uint256 hashBlock = GetRandHash();
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(db.GetBestBlock() == hashBlock);
+        for (size_t i = 0; i < vTxid.size(); i++) {
+            CCoins coins;
+            BOOST_CHECK_EQUAL(db.GetCoins(vTxid[i], coins), !vCoins[i].IsPruned());
+            BOOST_CHECK(coins == vCoins[i]);
+        }
+    }
+
+    BOOST_CHECK(db.Sync());
+    db.StopWriter();
+    for (size_t i = 0; i < vTxid.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK_EQUAL(db.GetCoins(vTxid[i], coins), !vCoins[i].IsPruned());
+        BOOST_CHECK(coins == vCoins[i]);
+    }
+}
+
+// Sync on a cache stacked on the database, as pcoinsTip is, only returns
+// once the background writer has the batch on disk
+BOOST_AUTO_TEST_CASE(coins_db_writer_sync_test)
+{
+    CCoinsViewDBSlow db;
+    db.StartWriter();
+    CCoinsViewBacked backed(&db);
+    CCoinsViewCache cache(&backed);
+
+    for (int nFlush = 1; nFlush <= 3; nFlush++) {
+        *cache.ModifyCoins(GetRandHash()) = RandomCoins(1, nFlush);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(cache.Sync());
+        BOOST_CHECK_EQUAL(db.nWrites, nFlush);
+    }
+}
+
+// A failed background write is reported once, and the coins it held can
+// still be read; later flushes fail
+BOOST_AUTO_TEST_CASE(coins_db_writer_error_test)
+{
+    CCoinsViewDBFailing db;
+    db.StartWriter();
+
+    uint256 txidA = GetRandHash();
+    CCoins coinsA = RandomCoins(2, 100);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txidA) = coinsA;
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.Sync());
+
+    db.fFail = true;
+    uint256 txidB = GetRandHash();
+    CCoins coinsB = RandomCoins(1, 101);
+    uint256 hashBlock = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txidA)->Spend(0);
+        *cache.ModifyCoins(txidB) = coinsB;
+        cache.SetBestBlock(hashBlock);
+        BOOST_CHECK(cache.Flush());
+    }
+    coinsA.Spend(0);
+    BOOST_CHECK(!db.Sync());
+
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txidB)->Spend(0);
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(!cache.Flush());
+    }
+    db.StopWriter();
+    BOOST_CHECK_EQUAL(db.nErrors, 1);
+
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txidA, coins));
+    BOOST_CHECK(coins == coinsA);
+    BOOST_CHECK(db.GetCoins(txidB, coins));
+    BOOST_CHECK(coins == coinsB);
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
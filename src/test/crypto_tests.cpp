@@ -4,6 +4,7 @@
 
 #include "crypto/rfc6979_hmac_sha256.h"
 #include "crypto/ripemd160.h"
+#include "crypto/scrypt.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
@@ -282,4 +283,57 @@ BOOST_AUTO_TEST_CASE(rfc6979_hmac_sha256)
             ("7597887cbd76321f32e30440679a22cf7f8d9d2eac390e581fea091ce202ba94"));
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    for (int i = 0; i <= 32; ++i) {
+        unsigned char in[64 * 32];
+        unsigned char out1[32 * 32], out2[32 * 32];
+        for (int j = 0; j < 64 * i; ++j) {
+            in[j] = insecure_rand();
+        }
+        for (int j = 0; j < i; ++j) {
+            unsigned char tmp[32];
+            CSHA256().Write(in + 64 * j, 64).Finalize(tmp);
+            CSHA256().Write(tmp, 32).Finalize(out1 + 32 * j);
+        }
+        SHA256D64(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sha256d80)
+{
+    for (int i = 0; i <= 32; ++i) {
+        unsigned char in[80 * 32];
+        unsigned char out1[32 * 32], out2[32 * 32];
+        for (int j = 0; j < 80 * i; ++j) {
+            in[j] = insecure_rand();
+        }
+        for (int j = 0; j < i; ++j) {
+            unsigned char tmp[32];
+            CSHA256().Write(in + 80 * j, 80).Finalize(tmp);
+            CSHA256().Write(tmp, 32).Finalize(out1 + 32 * j);
+        }
+        SHA256D80(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(scrypt_batch)
+{
+    // Every mix of 8-way, 4-way and single input calls up to 2 * 8 + 4 + 3
+    for (int i = 0; i <= 23; ++i) {
+        char in[80 * 23];
+        char out1[32 * 23], out2[32 * 23];
+        for (int j = 0; j < 80 * i; ++j) {
+            in[j] = insecure_rand();
+        }
+        for (int j = 0; j < i; ++j) {
+            scrypt_1024_1_1_256(in + 80 * j, out1 + 32 * j);
+        }
+        scrypt_1024_1_1_256_batch(in, out2, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,191 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "hash.h"
+#include "kernel.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+/**
+ * An in-memory chain of headers with stake modifiers, installed as
+ * chainActive in place of the genesis-only chain of the test setup.
+ */
+struct StakeTestChain {
+    std::vector<CBlock> vBlocks;
+    std::vector<CBlockIndex*> vpindex;
+    CBlockIndex* pindexOldTip;
+
+    StakeTestChain(int nBlocks, int nSpacing)
+    {
+        LOCK(cs_main);
+        pindexOldTip = chainActive.Tip();
+
+        vBlocks.resize(nBlocks);
+        int64_t nTimeStart = GetTime() - (int64_t)nBlocks * nSpacing;
+        CBlockIndex* pindexPrev = NULL;
+        for (int i = 0; i < nBlocks; i++) {
+            CBlock& block = vBlocks[i];
+            block.hashPrevBlock = pindexPrev ? pindexPrev->GetBlockHash() : uint256();
+            block.hashMerkleRoot = Hash(BEGIN(i), END(i));
+            block.nTime = nTimeStart + (int64_t)i * nSpacing;
+            block.nBits = 0x1e0ffff0;
+            block.nNonce = i;
+
+            CBlockIndex* pindex = new CBlockIndex(block);
+            BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first;
+            pindex->phashBlock = &mi->first;
+            pindex->pprev = pindexPrev;
+            pindex->nHeight = i;
+            pindex->BuildSkip();
+            if (i >= 100)
+                pindex->SetProofOfStake();
+
+            uint64_t nStakeModifier = 0;
+            bool fGeneratedStakeModifier = false;
+            BOOST_REQUIRE(ComputeNextStakeModifier(pindexPrev, nStakeModifier, fGeneratedStakeModifier));
+            pindex->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+            pindex->SetStakeEntropyBit(pindex->GetStakeEntropyBit());
+
+            vpindex.push_back(pindex);
+            pindexPrev = pindex;
+        }
+        chainActive.SetTip(pindexPrev);
+    }
+
+    ~StakeTestChain()
+    {
+        LOCK(cs_main);
+        chainActive.SetTip(pindexOldTip);
+        ClearStakeModifierWindow();
+        for (size_t i = 0; i < vpindex.size(); i++) {
+            mapBlockIndex.erase(vpindex[i]->GetBlockHash());
+            delete vpindex[i];
+        }
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search_matches_legacy)
+{
+    StakeTestChain chain(2000, 60);
+
+    // Candidates of different values from blocks all over the chain, the
+    // newest of them still immature at the earlier times tried
+    std::vector<CTransaction> vTxPrev;
+    std::vector<int> vHeightFrom;
+    for (int i = 0; i < 24; i++) {
+        CMutableTransaction mtx;
+        mtx.nLockTime = i;
+        mtx.vout.resize(2);
+        mtx.vout[0].nValue = (10 + 40 * i) * COIN;
+        mtx.vout[1].nValue = (500 - 20 * i) * COIN;
+        vTxPrev.push_back(CTransaction(mtx));
+        vHeightFrom.push_back(200 + 78 * i);
+    }
+
+    // Easy enough that roughly half the candidates find a kernel in the drift
+    const unsigned int nBits = 0x1c400000;
+    const unsigned int nHashDrift = 45;
+
+    CStakeKernelSearch search;
+    for (size_t i = 0; i < vTxPrev.size(); i++)
+        search.Add(COutPoint(vTxPrev[i].GetHash(), i % 2), vTxPrev[i].vout[i % 2].nValue, chain.vpindex[vHeightFrom[i]]);
+    {
+        LOCK(cs_main);
+        search.Prepare(nBits);
+    }
+
+    int nChecked = 0;
+    int nKernels = 0;
+    const unsigned int nTimeTip = chain.vpindex.back()->nTime;
+    for (unsigned int nTimeTx = nTimeTip - 2000; nTimeTx < nTimeTip + 2000; nTimeTx += 97) {
+        // Walk the candidates the way the minter does: Search stops at the
+        // first kernel and is resumed after it, the legacy scan checks
+        // every candidate in turn. The striped search over four threads has
+        // to stop at the same kernels.
+        size_t nIndex = 0;
+        size_t nIndexThreaded = 0;
+        for (size_t i = 0; i < vTxPrev.size(); i++) {
+            const COutPoint prevout(vTxPrev[i].GetHash(), i % 2);
+            unsigned int nTimeLegacy = nTimeTx;
+            uint256 hashLegacy;
+            nChecked++;
+            bool fLegacy = CheckStakeKernelHash(nBits, chain.vBlocks[vHeightFrom[i]], vTxPrev[i], prevout, nTimeLegacy, nHashDrift, false, hashLegacy);
+            if (!fLegacy)
+                continue;
+            nKernels++;
+
+            unsigned int nTimeSearch = 0;
+            uint256 hashSearch;
+            BOOST_CHECK(search.Search(nTimeTx, nHashDrift, nIndex, nTimeSearch, hashSearch));
+            BOOST_CHECK_EQUAL(nIndex, i);
+            BOOST_CHECK_EQUAL(nTimeSearch, nTimeLegacy);
+            BOOST_CHECK(hashSearch == hashLegacy);
+            nIndex = i + 1;
+
+            BOOST_CHECK(search.Search(nTimeTx, nHashDrift, nIndexThreaded, nTimeSearch, hashSearch, 4));
+            BOOST_CHECK_EQUAL(nIndexThreaded, i);
+            BOOST_CHECK_EQUAL(nTimeSearch, nTimeLegacy);
+            BOOST_CHECK(hashSearch == hashLegacy);
+            nIndexThreaded = i + 1;
+        }
+
+        // and neither finds anything after the last legacy kernel
+        unsigned int nTimeSearch = 0;
+        uint256 hashSearch;
+        BOOST_CHECK(!search.Search(nTimeTx, nHashDrift, nIndex, nTimeSearch, hashSearch));
+        BOOST_CHECK_EQUAL(nIndex, vTxPrev.size());
+        BOOST_CHECK(!search.Search(nTimeTx, nHashDrift, nIndexThreaded, nTimeSearch, hashSearch, 4));
+        BOOST_CHECK_EQUAL(nIndexThreaded, vTxPrev.size());
+    }
+
+    // Both outcomes have been compared
+    BOOST_CHECK(nKernels > 0);
+    BOOST_CHECK(nKernels < nChecked);
+}
+
+BOOST_AUTO_TEST_CASE(stake_kernel_search_threads_earliest_wins)
+{
+    StakeTestChain chain(2000, 60);
+
+    // So easy that every candidate has a kernel, and every stripe finds one
+    // at the same time
+    CStakeKernelSearch search;
+    for (int i = 0; i < 64; i++)
+        search.Add(COutPoint(Hash(BEGIN(i), END(i)), 0), 1000 * COIN, chain.vpindex[1000 + i]);
+    {
+        LOCK(cs_main);
+        search.Prepare(0x1d00ffff);
+    }
+
+    const unsigned int nTimeTx = chain.vpindex.back()->nTime;
+    for (int nThreads = 2; nThreads <= 8; nThreads++) {
+        for (size_t nStart = 0; nStart < 8; nStart++) {
+            size_t nIndex = nStart;
+            unsigned int nTimeExpected = 0;
+            uint256 hashExpected;
+            BOOST_CHECK(search.Search(nTimeTx, 60, nIndex, nTimeExpected, hashExpected));
+            BOOST_CHECK_EQUAL(nIndex, nStart);
+
+            // The earliest kernel in table order wins, whichever stripe
+            // finishes first
+            nIndex = nStart;
+            unsigned int nTimeThreaded = 0;
+            uint256 hashThreaded;
+            BOOST_CHECK(search.Search(nTimeTx, 60, nIndex, nTimeThreaded, hashThreaded, nThreads));
+            BOOST_CHECK_EQUAL(nIndex, nStart);
+            BOOST_CHECK_EQUAL(nTimeThreaded, nTimeExpected);
+            BOOST_CHECK(hashThreaded == hashExpected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,14 +6,256 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "primitives/transaction.h"
+#include "clientversion.h"
 #include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(main_tests)
 
+/** Write a block file record: network magic, size and the serialized data */
+static void WriteBlockRecord(CAutoFile& fileout, const std::vector<char>& vData, unsigned int nSize)
+{
+    fileout << FLATDATA(Params().MessageStart()) << nSize;
+    if (!vData.empty())
+        fileout.write(&vData[0], vData.size());
+}
+
+/** The blocks an importer hands out, as (hash, position), with a null hash for a record that did not deserialize */
+static std::vector<std::pair<uint256, unsigned int> > ImportBlockFile(const boost::filesystem::path& path, const CDiskBlockPos* dbp)
+{
+    std::vector<std::pair<uint256, unsigned int> > vImported;
+    FILE* file = fopen(path.string().c_str(), "rb");
+    BOOST_REQUIRE(file);
+    CBlockImporter importer(file, dbp);
+    CImportBlock* pimport;
+    while ((pimport = importer.Front()) != NULL) {
+        vImported.push_back(std::make_pair(pimport->fReadable ? pimport->hash : uint256(), pimport->fHavePos ? pimport->pos.nPos : 0));
+        importer.PopFront();
+    }
+    BOOST_CHECK(importer.GetReadError().empty());
+    return vImported;
+}
+
 BOOST_AUTO_TEST_CASE(subsidy_limit_test)
 {
 }
 
+BOOST_AUTO_TEST_CASE(recent_block_cache_test)
+{
+    // Blocks of the same shape, told apart by their nonce
+    std::vector<CBlock> vBlocks(5);
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nNonce = i;
+        vBlocks[i].vtx.resize(1);
+    }
+
+    size_t nBlockCacheSizeOld = nBlockCacheSize;
+    CRecentBlockCache cache;
+    nBlockCacheSize = DEFAULT_BLOCK_CACHE_SIZE << 20;
+    cache.Add(vBlocks[0]);
+    size_t nBlockUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nBlockUsage > 0);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 0);
+
+    // Room for three
+    nBlockCacheSize = 3 * nBlockUsage;
+    for (unsigned int i = 0; i < 3; i++)
+        cache.Add(vBlocks[i]);
+    cache.Add(vBlocks[1]);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 3 * nBlockUsage);
+
+    // Looking the first one up makes the second the least recently used,
+    // so that goes when a fourth comes in
+    boost::shared_ptr<const CBlock> pblock = cache.Get(vBlocks[0].GetHash());
+    BOOST_CHECK(pblock && pblock->GetHash() == vBlocks[0].GetHash());
+    cache.Add(vBlocks[3]);
+    BOOST_CHECK(!cache.Get(vBlocks[1].GetHash()));
+    for (unsigned int i = 0; i < 4; i++) {
+        if (i == 1)
+            continue;
+        pblock = cache.Get(vBlocks[i].GetHash());
+        BOOST_CHECK(pblock && pblock->GetHash() == vBlocks[i].GetHash());
+    }
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 3 * nBlockUsage);
+
+    // A block bigger than the whole cache is not kept, and evicts nothing
+    nBlockCacheSize = nBlockUsage - 1;
+    cache.Add(vBlocks[4]);
+    BOOST_CHECK(!cache.Get(vBlocks[4].GetHash()));
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 3 * nBlockUsage);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Get(vBlocks[0].GetHash()));
+    nBlockCacheSize = nBlockCacheSizeOld;
+}
+
+BOOST_AUTO_TEST_CASE(mn_tier_index_test)
+{
+    bool fTxIndexOld = fTxIndex;
+    fTxIndex = true;
+
+    // A block paying each tier's collateral, and an amount that is none
+    CMutableTransaction mtx;
+    mtx.vin.resize(1);
+    mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    mtx.vout.resize(4);
+    for (int nTier = 1; nTier <= 3; nTier++)
+        mtx.vout[nTier - 1].nValue = GetMNCollateral(0, nTier) * COIN;
+    mtx.vout[3].nValue = COIN;
+    CBlock block;
+    block.vtx.push_back(CTransaction(mtx));
+    const uint256 txid = block.vtx[0].GetHash();
+    const int nHeight = 100;
+
+    // Connecting the block indexes the collaterals
+    BOOST_CHECK(IndexMNTiers(block, nHeight));
+    for (unsigned int i = 0; i < 4; i++) {
+        int nTier = 0;
+        BOOST_CHECK_EQUAL(pblocktree->ReadMNTier(COutPoint(txid, i), nTier), i < 3);
+        BOOST_CHECK_EQUAL(GetMNTierByVin(COutPoint(txid, i)), i < 3 ? (int)i + 1 : 0);
+    }
+
+    // Disconnecting it forgets them, and the lookups find nothing
+    BOOST_CHECK(EraseMNTiers(block, nHeight));
+    for (unsigned int i = 0; i < 4; i++) {
+        int nTier = 0;
+        BOOST_CHECK(!pblocktree->ReadMNTier(COutPoint(txid, i), nTier));
+        BOOST_CHECK_EQUAL(GetMNTierByVin(COutPoint(txid, i)), 0);
+    }
+
+    // Connecting it again replaces the misses cached in between
+    BOOST_CHECK(IndexMNTiers(block, nHeight));
+    for (unsigned int i = 0; i < 4; i++) {
+        int nTier = 0;
+        BOOST_CHECK_EQUAL(pblocktree->ReadMNTier(COutPoint(txid, i), nTier), i < 3);
+        BOOST_CHECK_EQUAL(GetMNTierByVin(COutPoint(txid, i)), i < 3 ? (int)i + 1 : 0);
+    }
+
+    BOOST_CHECK(EraseMNTiers(block, nHeight));
+    fTxIndex = fTxIndexOld;
+}
+
+BOOST_AUTO_TEST_CASE(pow_hash_cache_test)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashPrevBlock = GetRandHash();
+    header.hashMerkleRoot = GetRandHash();
+    header.nTime = 1500000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 1;
+    const uint256 hashPoW = header.GetPoWHash();
+
+    CPoWHashCache cache;
+    BOOST_CHECK(cache.GetPoWHash(header) == hashPoW);
+    BOOST_CHECK(cache.GetPoWHash(header) == hashPoW);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+
+    // A change to any of the hashed fields is a different entry
+    std::vector<CBlockHeader> vChanged(6, header);
+    vChanged[0].nVersion++;
+    vChanged[1].hashPrevBlock = GetRandHash();
+    vChanged[2].hashMerkleRoot = GetRandHash();
+    vChanged[3].nTime++;
+    vChanged[4].nBits++;
+    vChanged[5].nNonce++;
+    for (unsigned int i = 0; i < vChanged.size(); i++) {
+        uint256 hashChanged = cache.GetPoWHash(vChanged[i]);
+        BOOST_CHECK(hashChanged == vChanged[i].GetPoWHash());
+        BOOST_CHECK(hashChanged != hashPoW);
+    }
+    BOOST_CHECK_EQUAL(cache.size(), 1U + vChanged.size());
+
+    // The same for hashes filled in a batch
+    CPoWHashCache cacheBatch;
+    std::vector<const CBlockHeader*> vpHeaders;
+    vpHeaders.push_back(&header);
+    for (unsigned int i = 0; i < vChanged.size(); i++)
+        vpHeaders.push_back(&vChanged[i]);
+    cacheBatch.Fill(vpHeaders);
+    BOOST_CHECK_EQUAL(cacheBatch.size(), vpHeaders.size());
+    BOOST_CHECK(cacheBatch.GetPoWHash(header) == hashPoW);
+    for (unsigned int i = 0; i < vChanged.size(); i++)
+        BOOST_CHECK(cacheBatch.GetPoWHash(vChanged[i]) == vChanged[i].GetPoWHash());
+    BOOST_CHECK_EQUAL(cacheBatch.size(), vpHeaders.size());
+
+    // and for a header changed in place after it was hashed
+    header.nNonce = 1000;
+    BOOST_CHECK(cacheBatch.GetPoWHash(header) == header.GetPoWHash());
+    BOOST_CHECK(cacheBatch.GetPoWHash(header) != hashPoW);
+}
+
+BOOST_AUTO_TEST_CASE(block_importer_test)
+{
+    std::vector<CBlock> vBlocks(4);
+    std::vector<std::vector<char> > vData(vBlocks.size());
+    for (unsigned int i = 0; i < vBlocks.size(); i++) {
+        vBlocks[i].nNonce = i;
+        vBlocks[i].vtx.resize(1);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << vBlocks[i];
+        vData[i].assign(ss.begin(), ss.end());
+    }
+
+    // Two blocks, a record too short to be a block, one that is not a
+    // block, a third block and the first half of a fourth, as left by a
+    // write that was cut off
+    boost::filesystem::path path = GetDataDir() / "import_test.dat";
+    std::vector<unsigned int> vPos;
+    unsigned int nPosResume = 0;
+    {
+        CAutoFile fileout(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        for (unsigned int i = 0; i < 2; i++) {
+            WriteBlockRecord(fileout, vData[i], vData[i].size());
+            vPos.push_back(ftell(fileout.Get()) - vData[i].size());
+        }
+        nPosResume = ftell(fileout.Get());
+        WriteBlockRecord(fileout, std::vector<char>(10, 0), 10);
+        WriteBlockRecord(fileout, std::vector<char>(200, (char)0xff), 200);
+        WriteBlockRecord(fileout, vData[2], vData[2].size());
+        vPos.push_back(ftell(fileout.Get()) - vData[2].size());
+        WriteBlockRecord(fileout, std::vector<char>(vData[3].begin(), vData[3].begin() + vData[3].size() / 2), vData[3].size());
+    }
+
+    // The corrupt record is handed out unreadable, in its place in the
+    // file, and the blocks around it are not lost
+    std::vector<std::pair<uint256, unsigned int> > vImported = ImportBlockFile(path, NULL);
+    BOOST_REQUIRE_EQUAL(vImported.size(), 4U);
+    BOOST_CHECK(vImported[0].first == vBlocks[0].GetHash());
+    BOOST_CHECK(vImported[1].first == vBlocks[1].GetHash());
+    BOOST_CHECK(vImported[2].first == uint256());
+    BOOST_CHECK(vImported[3].first == vBlocks[2].GetHash());
+
+    // As block file nFile, reading resumes after the part the block index
+    // already covers, and the blocks are given their positions in the file
+    const int nFile = 1000;
+    CBlockFileInfo info;
+    info.nSize = nPosResume;
+    BOOST_REQUIRE(pblocktree->WriteBlockFileInfo(nFile, info));
+    CDiskBlockPos posFile(nFile, 0);
+    vImported = ImportBlockFile(path, &posFile);
+    BOOST_REQUIRE_EQUAL(vImported.size(), 2U);
+    BOOST_CHECK(vImported[0].first == uint256());
+    BOOST_CHECK(vImported[1].first == vBlocks[2].GetHash());
+    BOOST_CHECK_EQUAL(vImported[1].second, vPos[2]);
+
+    // Without an entry in the block index the whole file is read
+    posFile.nFile = nFile + 1;
+    vImported = ImportBlockFile(path, &posFile);
+    BOOST_REQUIRE_EQUAL(vImported.size(), 4U);
+    BOOST_CHECK_EQUAL(vImported[0].second, vPos[0]);
+    BOOST_CHECK_EQUAL(vImported[1].second, vPos[1]);
+    BOOST_CHECK_EQUAL(vImported[3].second, vPos[2]);
+
+    boost::filesystem::remove(path);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
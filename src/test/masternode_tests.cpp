@@ -0,0 +1,149 @@
+// Copyright (c) 2018-2030 The CC developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "hash.h"
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "timedata.h"
+#include "utiltime.h"
+
+#include <map>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+/**
+ * A short chain of headers installed as chainActive, so that Masternode
+ * scores have blocks to be computed from, and a list of Masternodes that
+ * pass Check() without a collateral lookup.
+ */
+struct MasternodeTestSetup {
+    std::vector<CBlockIndex*> vpindex;
+    CBlockIndex* pindexOldTip;
+    std::vector<CTxIn> vVins;
+
+    MasternodeTestSetup(int nBlocks, int nMasternodes)
+    {
+        LOCK(cs_main);
+        pindexOldTip = chainActive.Tip();
+
+        CBlockIndex* pindexPrev = NULL;
+        for (int i = 0; i < nBlocks; i++) {
+            CBlock block;
+            block.hashPrevBlock = pindexPrev ? pindexPrev->GetBlockHash() : uint256();
+            block.hashMerkleRoot = Hash(BEGIN(i), END(i));
+            block.nTime = GetTime() - (nBlocks - i) * 60;
+            block.nBits = 0x1e0ffff0;
+
+            CBlockIndex* pindex = new CBlockIndex(block);
+            BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(block.GetHash(), pindex)).first;
+            pindex->phashBlock = &mi->first;
+            pindex->pprev = pindexPrev;
+            pindex->nHeight = i;
+            pindex->BuildSkip();
+            vpindex.push_back(pindex);
+            pindexPrev = pindex;
+        }
+        chainActive.SetTip(pindexPrev);
+
+        mnodeman.Clear();
+        for (int i = 0; i < nMasternodes; i++) {
+            CMasternode mn;
+            mn.vin = CTxIn(COutPoint(Hash(BEGIN(i), END(i)), i % 2));
+            mn.unitTest = true;
+            mn.sigTime = GetAdjustedTime() - 24 * 60 * 60;
+            mn.lastPing.vin = mn.vin;
+            mn.lastPing.sigTime = GetAdjustedTime();
+            BOOST_REQUIRE(mnodeman.Add(mn));
+            vVins.push_back(mn.vin);
+        }
+    }
+
+    ~MasternodeTestSetup()
+    {
+        mnodeman.Clear();
+
+        LOCK(cs_main);
+        chainActive.SetTip(pindexOldTip);
+        for (size_t i = 0; i < vpindex.size(); i++) {
+            mapBlockIndex.erase(vpindex[i]->GetBlockHash());
+            delete vpindex[i];
+        }
+    }
+
+    std::map<COutPoint, int> GetRanks(int nBlockHeight)
+    {
+        std::map<COutPoint, int> mapRanks;
+        for (size_t i = 0; i < vVins.size(); i++)
+            mapRanks[vVins[i].prevout] = mnodeman.GetMasternodeRank(vVins[i], nBlockHeight, PROTOCOL_VERSION);
+        return mapRanks;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+BOOST_AUTO_TEST_CASE(masternode_rank_check_test)
+{
+    MasternodeTestSetup setup(20, 10);
+    const int nBlockHeight = 15;
+
+    std::map<COutPoint, int> mapRanks = setup.GetRanks(nBlockHeight);
+    CTxIn vinFirst;
+    for (size_t i = 0; i < setup.vVins.size(); i++) {
+        int nRank = mapRanks[setup.vVins[i].prevout];
+        BOOST_CHECK(nRank >= 1 && nRank <= (int)setup.vVins.size());
+        CMasternode* pmn = mnodeman.GetMasternodeByRank(nRank, nBlockHeight, PROTOCOL_VERSION, true);
+        BOOST_REQUIRE(pmn != NULL);
+        BOOST_CHECK(pmn->vin == setup.vVins[i]);
+        if (nRank == 1)
+            vinFirst = setup.vVins[i];
+    }
+
+    // A Check() that leaves every state as it was keeps the ranks
+    for (size_t i = 0; i < setup.vVins.size(); i++)
+        mnodeman.Find(setup.vVins[i])->Check(true);
+    BOOST_CHECK(setup.GetRanks(nBlockHeight) == mapRanks);
+
+    // The first Masternode expires in a Check() through its pointer; the
+    // cached table must not keep ranking it
+    CMasternode* pmnFirst = mnodeman.Find(vinFirst);
+    BOOST_REQUIRE(pmnFirst != NULL);
+    int64_t nPingTime = pmnFirst->lastPing.sigTime;
+    pmnFirst->lastPing.sigTime = GetAdjustedTime() - MASTERNODE_EXPIRATION_SECONDS - 60;
+    pmnFirst->Check(true);
+    BOOST_CHECK(!pmnFirst->IsEnabled());
+
+    std::map<COutPoint, int> mapRanksExpired = setup.GetRanks(nBlockHeight);
+    for (size_t i = 0; i < setup.vVins.size(); i++) {
+        const COutPoint& prevout = setup.vVins[i].prevout;
+        if (setup.vVins[i] == vinFirst)
+            BOOST_CHECK_EQUAL(mapRanksExpired[prevout], -1);
+        else
+            BOOST_CHECK_EQUAL(mapRanksExpired[prevout], mapRanks[prevout] - 1);
+    }
+    CMasternode* pmn = mnodeman.GetMasternodeByRank(1, nBlockHeight, PROTOCOL_VERSION, true);
+    BOOST_REQUIRE(pmn != NULL);
+    BOOST_CHECK(pmn->vin != vinFirst);
+
+    // and ranks it again once it is back
+    pmnFirst->lastPing.sigTime = nPingTime;
+    pmnFirst->Check(true);
+    BOOST_CHECK(pmnFirst->IsEnabled());
+    BOOST_CHECK(setup.GetRanks(nBlockHeight) == mapRanks);
+}
+
+BOOST_AUTO_TEST_CASE(masternode_rank_unknown_block_test)
+{
+    MasternodeTestSetup setup(20, 10);
+
+    // Without the block every Masternode still has a rank
+    const int nBlockHeight = 100;
+    for (int nRank = 1; nRank <= (int)setup.vVins.size(); nRank++)
+        BOOST_CHECK(mnodeman.GetMasternodeByRank(nRank, nBlockHeight, PROTOCOL_VERSION, true) != NULL);
+    BOOST_CHECK(mnodeman.GetMasternodeByRank(setup.vVins.size() + 1, nBlockHeight, PROTOCOL_VERSION, true) == NULL);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
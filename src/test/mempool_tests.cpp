@@ -99,4 +99,209 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorDescendantTest)
+{
+    // A chain of three transactions, each spending the one before
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            tx[i].vin[0].prevout = COutPoint(tx[i - 1].GetHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+    }
+
+    CTxMemPool testPool(CFeeRate(0));
+    CAmount nFees[3] = {4000LL, 1000LL, 2000LL};
+    for (int i = 0; i < 3; i++)
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 0, 0.0, 1));
+    unsigned int nTxSize = ::GetSerializeSize(CTransaction(tx[0]), SER_NETWORK, PROTOCOL_VERSION);
+
+    CTxMemPool::txiter it = testPool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 7000LL);
+    it = testPool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 7000LL);
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+
+    // Alone the last transaction pays more than the middle one, with its
+    // ancestors it pays less
+    CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator mit = testPool.mapTx.get<mining_score>().begin();
+    BOOST_CHECK(mit->GetTx().GetHash() == tx[0].GetHash());
+    BOOST_CHECK((++mit)->GetTx().GetHash() == tx[2].GetHash());
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ait = testPool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK(ait->GetTx().GetHash() == tx[0].GetHash());
+    BOOST_CHECK((++ait)->GetTx().GetHash() == tx[1].GetHash());
+
+    // Too long a chain for the limits
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    CMutableTransaction txChild = tx[0];
+    txChild.vin[0].prevout = COutPoint(tx[2].GetHash(), 0);
+    CTxMemPoolEntry entryChild(txChild, 0, 0, 0.0, 1);
+    BOOST_CHECK(testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 4, 1000000, 4, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 3, 1000000, 4, 1000000, errString));
+
+    // Removing the middle one takes its descendant along and updates the first
+    std::list<CTransaction> removed;
+    testPool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    it = testPool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 4000LL);
+
+    // A reorg puts the first two back, in block order, after the last one
+    // was accepted while they were confirmed
+    CTxMemPool reorgPool(CFeeRate(0));
+    reorgPool.addUnchecked(tx[2].GetHash(), CTxMemPoolEntry(tx[2], nFees[2], 0, 0.0, 1));
+    std::vector<uint256> vHashUpdate;
+    for (int i = 0; i < 2; i++) {
+        reorgPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], nFees[i], 0, 0.0, 1));
+        vHashUpdate.push_back(tx[i].GetHash());
+    }
+    reorgPool.UpdateTransactionsFromBlock(vHashUpdate);
+    it = reorgPool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithDescendants(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 7000LL);
+    it = reorgPool.mapTx.find(tx[1].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 3000LL);
+    it = reorgPool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithAncestors(), 7000LL);
+    BOOST_CHECK_EQUAL(reorgPool.GetMemPoolParents(it).size(), 1);
+
+    // and the links hold up when the middle one goes again
+    removed.clear();
+    reorgPool.remove(tx[1], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    it = reorgPool.mapTx.find(tx[0].GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+
+    // A parent paying little with a child paying a lot, and a lone
+    // transaction in between
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000LL, 0, 10.0, 1));
+
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 10.0, 1));
+
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_3;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 10.0, 1));
+
+    // The parent with its child pays the best fee rate, so tx2 goes first
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    // The minimum fee is what tx2 paid plus the relay fee, and stays until a block
+    unsigned int nTx2Size = ::GetSerializeSize(CTransaction(tx2), SER_NETWORK, PROTOCOL_VERSION);
+    CFeeRate minFee(CFeeRate(5000LL, nTx2Size).GetFeePerK() + 1000);
+    BOOST_CHECK(pool.GetMinFee(1) == minFee);
+
+    // Trimming to nothing takes the child along with the parent
+    pool.TrimToSize(0);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolReorgSizeLimitTest)
+{
+    // A confirmed transaction with two outputs funds everything
+    CMutableTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].scriptSig = CScript() << OP_1;
+    txFund.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txFund.vout[i].scriptPubKey = CScript() << OP_1;
+        txFund.vout[i].nValue = 10 * COIN;
+    }
+    CCoinsViewCache coins(pcoinsTip);
+    *coins.ModifyCoins(txFund.GetHash()) = CCoins(txFund, 1);
+
+    // A parent paying nothing whose child pays a little, and a lone
+    // transaction paying more than the two together
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout = COutPoint(txFund.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_2;
+    txParent.vout[0].nValue = 10 * COIN;
+
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_3;
+    txChild.vout[0].nValue = 10 * COIN - 1000;
+
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].prevout = COutPoint(txFund.GetHash(), 1);
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_4;
+    txOther.vout[0].nValue = 10 * COIN - 10000;
+
+    // The child and the other one were accepted while the parent was
+    // confirmed, and fill the pool
+    CTxMemPool pool(CFeeRate(1000));
+    pool.setSanityCheck(true);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000LL, 0, 0.0, 1));
+    pool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 10000LL, 0, 0.0, 1));
+    size_t nLimit = pool.DynamicMemoryUsage();
+
+    // The block is disconnected: the parent comes back over the limit and
+    // is linked to its child before the pool is trimmed, as DisconnectTip does
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0LL, 0, 0.0, 1));
+    std::vector<uint256> vHashUpdate;
+    vHashUpdate.push_back(txParent.GetHash());
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+    pool.check(&coins);
+    CTxMemPool::txiter it = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK_EQUAL(it->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it->GetModFeesWithDescendants(), 1000LL);
+
+    // Trimming evicts the parent as a package with its child, not the
+    // parent alone
+    pool.TrimToSize(nLimit);
+    BOOST_CHECK(!pool.exists(txParent.GetHash()));
+    BOOST_CHECK(!pool.exists(txChild.GetHash()));
+    BOOST_CHECK(pool.exists(txOther.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() <= nLimit);
+    pool.check(&coins);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
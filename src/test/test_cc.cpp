@@ -4,6 +4,8 @@
 
 #define BOOST_TEST_MODULE CC Test Suite
 
+#include "crypto/scrypt.h"
+#include "crypto/sha256.h"
 #include "main.h"
 #include "random.h"
 #include "txdb.h"
@@ -31,6 +33,8 @@ struct TestingSetup {
 
     TestingSetup() {
         SetupEnvironment();
+        SHA256AutoDetect();
+        ScryptAutoDetect();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
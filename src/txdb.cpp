@@ -5,72 +5,424 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+//! One record per unspent output: DB_COIN_OUT, txid, VARINT(n) -> CCoinsOutRecord
+const char DB_COIN_OUT = 'C';
+//! One record per transaction, the layout CCoinsViewDB::Upgrade converts from
+const char DB_COINS = 'c';
+//! Best block, under the key used by versions from before the upgrade
+const char DB_BEST_BLOCK_OLD = 'B';
+//! Best block. The upgrade moves it away from DB_BEST_BLOCK_OLD, so that an
+//! older version finds no chainstate and rebuilds it, instead of taking the
+//! converted one for a chainstate without any coins.
+const char DB_BEST_BLOCK = 'H';
+//! Layout version, written as the upgrade starts
+const char DB_VERSION = 'V';
+const int CHAINSTATE_VERSION = 1;
+
+//! Bytes of old records converted per batch write by CCoinsViewDB::Upgrade
+const size_t UPGRADE_BATCH_SIZE = 16 << 20;
+
+/** Key of the record of output n of txid */
+struct CCoinsOutKey {
+    uint256 txid;
+    unsigned int n;
+
+    CCoinsOutKey() : n(0) {}
+    CCoinsOutKey(const uint256& txidIn, unsigned int nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        char chType = DB_COIN_OUT;
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Value of the record of output n of coins. The transaction fields of the
+ * CCoins are repeated in every record of it; reading one sets them and
+ * vout[n], growing vout as needed.
+ */
+class CCoinsOutRecord
+{
+private:
+    CCoins& coins;
+    unsigned int n;
+
+public:
+    CCoinsOutRecord(CCoins& coinsIn, unsigned int nIn) : coins(coinsIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned int nCode = 4 * coins.nHeight + (coins.fCoinBase ? 1 : 0) + (coins.fCoinStake ? 2 : 0);
+        READWRITE(VARINT(coins.nVersion));
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            coins.nHeight = nCode / 4;
+            coins.fCoinBase = nCode & 1;
+            coins.fCoinStake = (nCode & 2) != 0;
+            if (coins.vout.size() <= n)
+                coins.vout.resize(n + 1);
+        }
+        CTxOutCompressor txout(REF(coins.vout[n]));
+        READWRITE(txout);
+    }
+};
+
+/** Serialized key prefix shared by the records of all outputs of txid */
+CDataStream CoinsOutPrefix(const uint256& txid)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair(DB_COIN_OUT, txid);
+    return ssPrefix;
 }
+} // anon namespace
 
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
-    batch.Write('B', hash);
+    batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), pthreadWriter(NULL), fWriting(false), fWriteError(false), fStopWriter(false)
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    StopWriter();
+}
+
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    {
+        boost::unique_lock<boost::mutex> lock(csWriter);
+        if (fWriting || fWriteError) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end() && (it->second.flags & CCoinsCacheEntry::DIRTY)) {
+                coins = it->second.coins;
+                return !coins.IsPruned();
+            }
+        }
+    }
+
+    // The records of the outputs of txid are adjacent in the database
+    CDataStream ssPrefix = CoinsOutPrefix(txid);
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    coins.Clear();
+    bool fFound = false;
+    for (pcursor->Seek(slPrefix); pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutKey key;
+        ssKey >> key;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinsOutRecord record(coins, key.n);
+        ssValue >> record;
+        fFound = true;
+    }
+    HandleError(pcursor->status());
+    return fFound;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    {
+        boost::unique_lock<boost::mutex> lock(csWriter);
+        if (fWriting || fWriteError) {
+            CCoinsMap::const_iterator it = mapWriting.find(txid);
+            if (it != mapWriting.end() && (it->second.flags & CCoinsCacheEntry::DIRTY))
+                return !it->second.coins.IsPruned();
+        }
+    }
+
+    CDataStream ssPrefix = CoinsOutPrefix(txid);
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    pcursor->Seek(slPrefix);
+    if (pcursor->Valid())
+        return pcursor->key().starts_with(slPrefix);
+    HandleError(pcursor->status());
+    return false;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
 {
+    {
+        boost::unique_lock<boost::mutex> lock(csWriter);
+        if ((fWriting || fWriteError) && hashWriting != uint256(0))
+            return hashWriting;
+    }
+
     uint256 hashBestChain;
-    if (!db.Read('B', hashBestChain))
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256(0);
     return hashBestChain;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+void CCoinsViewDB::WriteCoins(CLevelDBBatch& batch, const CCoinsMap& mapCoins, const uint256& hashBlock)
 {
-    CLevelDBBatch batch;
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+    size_t nWritten = 0, nErased = 0;
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        const CCoinsCacheEntry& entry = it->second;
+        if (entry.flags & CCoinsCacheEntry::DIRTY) {
+            // Only outputs that were created or spent since the entry was read
+            // from here change, unless the transaction was added again at
+            // another height; outputs are never modified in place
+            bool fFresh = entry.flags & CCoinsCacheEntry::FRESH;
+            bool fReplaced = !fFresh && entry.coins.nHeight != entry.nBaseHeight;
+            unsigned int nOutputs = std::max(entry.coins.vout.size(), entry.vBaseAvail.size());
+            for (unsigned int n = 0; n < nOutputs; n++) {
+                bool fAvail = entry.coins.IsAvailable(n);
+                bool fInBase = !fFresh && n < entry.vBaseAvail.size() && entry.vBaseAvail[n];
+                if (fAvail && (!fInBase || fReplaced)) {
+                    batch.Write(CCoinsOutKey(it->first, n), CCoinsOutRecord(REF(entry.coins), n));
+                    nWritten++;
+                } else if (!fAvail && fInBase) {
+                    batch.Erase(CCoinsOutKey(it->first, n));
+                    nErased++;
+                }
+            }
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u), %u outputs written and %u erased, to coin database...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)nWritten, (unsigned int)nErased);
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    if (!pthreadWriter) {
+        CLevelDBBatch batch;
+        WriteCoins(batch, mapCoins, hashBlock);
+        mapCoins.clear();
+        return WriteToDisk(batch);
+    }
+
+    // Hand the entries over to the writer thread; they are served from
+    // mapWriting until they are on disk. A second flush waits for the first.
+    boost::unique_lock<boost::mutex> lock(csWriter);
+    while (fWriting)
+        condWriter.wait(lock);
+    if (fWriteError)
+        return false;
+    mapWriting.swap(mapCoins);
+    hashWriting = hashBlock;
+    fWriting = true;
+    condWriter.notify_all();
+    return true;
+}
+
+void CCoinsViewDB::ThreadWrite()
+{
+    while (true) {
+        {
+            boost::unique_lock<boost::mutex> lock(csWriter);
+            while (!fWriting && !fStopWriter)
+                condWriter.wait(lock);
+            if (!fWriting)
+                return;
+        }
+
+        // mapWriting is not modified while fWriting is set, so it can be
+        // read here without the lock, concurrently with GetCoins
+        int64_t nStart = GetTimeMillis();
+        bool fOk = false;
+        try {
+            CLevelDBBatch batch;
+            WriteCoins(batch, mapWriting, hashWriting);
+            fOk = WriteToDisk(batch);
+        } catch (const std::exception& e) {
+            LogPrintf("%s : error writing to coin database - %s\n", __func__, e.what());
+        }
+
+        if (!fOk) {
+            // The entries are nowhere else, so keep serving them from
+            // mapWriting, which is never replaced again, and stop the node
+            {
+                boost::unique_lock<boost::mutex> lock(csWriter);
+                fWriting = false;
+                fWriteError = true;
+                condWriter.notify_all();
+            }
+            OnWriteError();
+            continue;
+        }
+        LogPrint("coindb", "Wrote %u transactions to coin database in %dms\n", (unsigned int)mapWriting.size(), GetTimeMillis() - nStart);
+
+        CCoinsMap mapWritten;
+        {
+            boost::unique_lock<boost::mutex> lock(csWriter);
+            mapWritten.swap(mapWriting);
+            hashWriting = uint256(0);
+            fWriting = false;
+            condWriter.notify_all();
+        }
+        // The written entries are freed here, outside the lock
+    }
+}
+
+bool CCoinsViewDB::WriteToDisk(CLevelDBBatch& batch)
+{
     return db.WriteBatch(batch);
 }
 
+void CCoinsViewDB::OnWriteError()
+{
+    AbortNode("Failed to write to coin database");
+}
+
+void CCoinsViewDB::StartWriter()
+{
+    if (!pthreadWriter)
+        pthreadWriter = new boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "coinsdb", boost::function<void()>(boost::bind(&CCoinsViewDB::ThreadWrite, this))));
+}
+
+void CCoinsViewDB::StopWriter()
+{
+    if (!pthreadWriter)
+        return;
+    {
+        boost::unique_lock<boost::mutex> lock(csWriter);
+        fStopWriter = true;
+        condWriter.notify_all();
+    }
+    pthreadWriter->join();
+    delete pthreadWriter;
+    pthreadWriter = NULL;
+}
+
+bool CCoinsViewDB::Sync() const
+{
+    boost::unique_lock<boost::mutex> lock(csWriter);
+    while (fWriting)
+        condWriter.wait(lock);
+    return !fWriteError;
+}
+
+bool CCoinsViewDB::CheckVersion() const
+{
+    int nVersion = 0;
+    if (db.Exists(DB_VERSION) && !db.Read(DB_VERSION, nVersion))
+        return error("%s : unreadable chainstate version", __func__);
+    if (nVersion > CHAINSTATE_VERSION)
+        return error("%s : chainstate version %d is newer than %d", __func__, nVersion, CHAINSTATE_VERSION);
+    if (nVersion > 0 && db.Exists(DB_BEST_BLOCK_OLD))
+        return error("%s : chainstate was written by an older version after its upgrade", __func__);
+    return true;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    // Mark the chainstate and move the best block first, in one batch, so
+    // that an older version never loads a partly converted one either
+    if (!db.Exists(DB_VERSION)) {
+        CLevelDBBatch batch;
+        batch.Write(DB_VERSION, CHAINSTATE_VERSION);
+        uint256 hashBestChain;
+        if (db.Read(DB_BEST_BLOCK_OLD, hashBestChain)) {
+            batch.Write(DB_BEST_BLOCK, hashBestChain);
+            batch.Erase(DB_BEST_BLOCK_OLD);
+        }
+        if (!db.WriteBatch(batch))
+            return error("%s : error writing to coin database", __func__);
+    }
+
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COINS;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(slPrefix);
+    if (!pcursor->Valid() || !pcursor->key().starts_with(slPrefix)) {
+        HandleError(pcursor->status());
+        return true;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    LogPrintf("Upgrading the chainstate database to one record per unspent output...\n");
+    uiInterface.InitMessage(_("Upgrading chainstate database..."));
+
+    // Each batch replaces whole transactions, so a restart after an
+    // interruption or a shutdown request carries on with what is left in
+    // the old layout
+    CLevelDBBatch batch;
+    size_t nBatchSize = 0;
+    size_t nTransactions = 0, nOutputs = 0;
+    for (; pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        leveldb::Slice slValue = pcursor->value();
+        uint256 txid;
+        CCoins coins;
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType >> txid;
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> coins;
+        } catch (const std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+
+        for (unsigned int n = 0; n < coins.vout.size(); n++) {
+            if (coins.IsAvailable(n)) {
+                batch.Write(CCoinsOutKey(txid, n), CCoinsOutRecord(coins, n));
+                nOutputs++;
+            }
+        }
+        batch.Erase(make_pair(DB_COINS, txid));
+        nTransactions++;
+
+        nBatchSize += slKey.size() + slValue.size();
+        if (nBatchSize > UPGRADE_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                return error("%s : error writing to coin database", __func__);
+            batch.Clear();
+            nBatchSize = 0;
+            LogPrintf("Upgraded %u transactions...\n", (unsigned int)nTransactions);
+            if (ShutdownRequested()) {
+                LogPrintf("Chainstate upgrade interrupted, it continues on the next start\n");
+                return true;
+            }
+        }
+    }
+    HandleError(pcursor->status());
+    if (!db.WriteBatch(batch))
+        return error("%s : error writing to coin database", __func__);
+
+    LogPrintf("Upgraded %u transactions with %u unspent outputs in %dms\n", (unsigned int)nTransactions, (unsigned int)nOutputs, GetTimeMillis() - nStart);
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -114,57 +466,77 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
+/** Add the unspent outputs of one transaction to stats and the hash of the set */
+static void ApplyStats(CCoinsStats& stats, CHashWriter& ss, const uint256& txhash, const CCoins& coins)
+{
+    ss << txhash;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i + 1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    stats.nSerializedSize += 32;
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
 {
+    if (!Sync())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << DB_COIN_OUT;
+    leveldb::Slice slPrefix(&ssPrefix[0], ssPrefix.size());
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
+    stats.nTotalAmount = 0;
+
+    // The records of a transaction are adjacent; collect them into one CCoins
+    // so that the hash of the set does not depend on the database layout
+    uint256 txhash;
+    CCoins coins;
+    bool fHaveCoins = false;
+    for (pcursor->Seek(slPrefix); pcursor->Valid() && pcursor->key().starts_with(slPrefix); pcursor->Next()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
+            CCoinsOutKey key;
+            ssKey >> key;
+            if (fHaveCoins && key.txid != txhash) {
+                ApplyStats(stats, ss, txhash, coins);
+                coins.Clear();
             }
-            pcursor->Next();
+            txhash = key.txid;
+            fHaveCoins = true;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoinsOutRecord record(coins, key.n);
+            ssValue >> record;
+            stats.nSerializedSize += slValue.size();
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
         }
     }
+    if (fHaveCoins)
+        ApplyStats(stats, ss, txhash, coins);
     stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -181,6 +553,27 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadMNTier(const COutPoint& outpoint, int& nTier)
+{
+    return Read(make_pair('m', outpoint), nTier);
+}
+
+bool CBlockTreeDB::WriteMNTiers(const std::vector<std::pair<COutPoint, int> >& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<COutPoint, int> >::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Write(make_pair('m', it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::EraseMNTiers(const std::vector<COutPoint>& vect)
+{
+    CLevelDBBatch batch;
+    for (std::vector<COutPoint>::const_iterator it = vect.begin(); it != vect.end(); it++)
+        batch.Erase(make_pair('m', *it));
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
@@ -14,6 +14,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CCoins;
 class uint256;
 
@@ -24,20 +26,60 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ * Once StartWriter is called, BatchWrite returns as soon as it has taken the
+ * entries, and a background thread writes them, together with the best
+ * block, in one atomic batch. The database on disk therefore always matches
+ * its best block; until the batch is written, reads are answered from it.
+ * If the write fails, the node is shut down and reads keep being answered
+ * from the batch; further BatchWrite calls fail.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
 
+    //! Write one batch to db; virtual so that tests can make it fail
+    virtual bool WriteToDisk(CLevelDBBatch& batch);
+    //! Called on the writer thread after a failed write; aborts the node
+    virtual void OnWriteError();
+
+private:
+    boost::thread* pthreadWriter;
+    mutable boost::mutex csWriter;
+    mutable boost::condition_variable condWriter;
+    CCoinsMap mapWriting; // The entries being written; not modified while fWriting or fWriteError is set
+    uint256 hashWriting;
+    bool fWriting;
+    bool fWriteError;
+    bool fStopWriter;
+
+    static void WriteCoins(CLevelDBBatch& batch, const CCoinsMap& mapCoins, const uint256& hashBlock);
+    void ThreadWrite();
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+    //! False if the chainstate has a layout this version cannot read, or was
+    //! written by an older version after its upgrade; it needs a -reindex then
+    bool CheckVersion() const;
+    //! Convert a database with one record per transaction to one record per unspent output.
+    //! Stops early, returning true, when shutdown is requested; false on a write error.
+    bool Upgrade();
+    //! Write batches on a background thread from now on
+    void StartWriter();
+    //! Write the pending batch, if any, and stop the background thread
+    void StopWriter();
+    //! Wait until the pending batch, if any, is on disk; false if a write failed
+    bool Sync() const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -60,6 +102,9 @@ public:
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    bool ReadMNTier(const COutPoint& outpoint, int& nTier);
+    bool WriteMNTiers(const std::vector<std::pair<COutPoint, int> >& list);
+    bool EraseMNTiers(const std::vector<COutPoint>& list);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool LoadBlockIndexGuts();
@@ -7,12 +7,16 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -33,6 +37,13 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction, an entry keeps statistics over itself and all of
+ * its in-mempool ancestors, and over itself and all of its in-mempool
+ * descendants: count, size and modified fees (fee plus PrioritiseTransaction
+ * delta). CTxMemPool updates them as transactions enter and leave the pool,
+ * so block assembly can rank transactions together with their unconfirmed
+ * parents without walking the pool.
  */
 class CTxMemPoolEntry
 {
@@ -44,6 +55,16 @@ private:
     int64_t nTime;        //! Local time when entering the mempool
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
+    CAmount nFeeDelta;    //! Fee delta from PrioritiseTransaction
+    size_t nUsageSize;    //! ... and total memory usage
+
+    uint64_t nCountWithDescendants;  //! number of descendant transactions, this one included
+    uint64_t nSizeWithDescendants;   //! ... and their total size
+    CAmount nModFeesWithDescendants; //! ... and their total modified fees
+
+    uint64_t nCountWithAncestors;  //! number of ancestor transactions, this one included
+    uint64_t nSizeWithAncestors;   //! ... and their total size
+    CAmount nModFeesWithAncestors; //! ... and their total modified fees
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
@@ -53,11 +74,155 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    /** Adjust the descendant statistics by the given differences */
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Adjust the ancestor statistics by the given differences */
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Replace the PrioritiseTransaction delta, updating the modified fee totals */
+    void UpdateFeeDelta(CAmount nNewFeeDelta);
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_descendant_state {
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_ancestor_state {
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) : modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+private:
+    int64_t modifySize;
+    CAmount modifyFee;
+    int64_t modifyCount;
+};
+
+struct update_fee_delta {
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) {}
+
+    void operator()(CTxMemPoolEntry& e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+// extracts a transaction hash from CTxMemPoolEntry or CTransaction
+struct mempoolentry_txid {
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/** Sort by modified fee rate, highest first, then by hash */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort by the modified fee rate of the transaction together with its ancestors, highest first */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = (double)a.GetModFeesWithAncestors() * b.GetSizeWithAncestors();
+        double f2 = (double)b.GetModFeesWithAncestors() * a.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/**
+ * Sort by the higher of the transaction's own modified fee rate and that of
+ * it with all its in-mempool descendants, lowest first. A low-fee parent
+ * with a high-fee child sorts by the package, so it is not evicted first.
+ * The first entry is the cheapest one to evict together with its descendants.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+
+        if (f1 == f2) {
+            // Newer transactions go first
+            if (a.GetTime() != b.GetTime())
+                return a.GetTime() > b.GetTime();
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 < f2;
+    }
+
+    // Calculate which score to use for an entry (avoiding division).
+    bool UseDescendantScore(const CTxMemPoolEntry& a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/** Sort by entry time, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
 };
 
+// Multi_index tag names
+struct descendant_score {};
+struct mining_score {};
+struct ancestor_score {};
+struct entry_time {};
+
 class CMinerPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -90,6 +255,26 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * mapTx is a boost::multi_index that orders the entries five ways:
+ * - by txid
+ * - by descendant score (descendant_score), the order of eviction
+ * - by modified fee rate (mining_score)
+ * - by entry time (entry_time)
+ * - by modified fee rate together with all in-mempool ancestors (ancestor_score)
+ *
+ * The in-mempool parents and children of every entry are kept in mapLinks.
+ * Adding a transaction updates the descendant statistics of all of its
+ * ancestors; removing one updates its ancestors, and for transactions that
+ * leave because they were mined, the ancestor statistics of its descendants.
+ *
+ * The pool is bounded by -maxmempool, in bytes of memory actually used
+ * (DynamicMemoryUsage). TrimToSize evicts the transaction with the lowest
+ * descendant score together with its descendants until the pool fits, and
+ * raises a rolling minimum fee rate to what the evicted package paid, so
+ * that it, or the like, cannot simply come back. That minimum decays with
+ * a half-life of ROLLING_FEE_HALFLIFE, starting once a block arrives.
+ * Transactions older than -mempoolexpiry are removed by Expire.
  */
 class CTxMemPool
 {
@@ -100,13 +285,96 @@ private:
 
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+
+    bool fLoaded; //! the transactions saved at the last shutdown have been loaded back
+
+    void trackPackageRemoved(const CFeeRate& rate);
 
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate, the higher of alone and with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore>,
+            // sorted by fee rate
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore>,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime>,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee> > >
+        indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter& a, const txiter& b) const
+        {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+    typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    /** Add or remove entry as a descendant of each of setAncestors, and as a child of its parents */
+    void UpdateAncestorsOf(bool add, txiter it, const setEntries& setAncestors);
+    /** Set the ancestor statistics of a new entry from its ancestors */
+    void UpdateEntryForAncestors(txiter it, const setEntries& setAncestors);
+    /**
+     * Add the in-pool descendants of updateIt that are not in setExclude to
+     * its descendant statistics, and updateIt to their ancestor statistics.
+     * cachedDescendants holds the results for entries already updated.
+     */
+    void UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendants, const std::set<uint256>& setExclude);
+    /** Detach the children of a removed entry from it */
+    void UpdateChildrenForRemoval(txiter entry);
+    /**
+     * Update the statistics of the transactions that stay, for the removal
+     * of entriesToRemove. updateDescendants is for removals that leave the
+     * descendants in the pool, as when a transaction is mined.
+     */
+    void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants);
+    /** Remove a set of entries, all statistics are updated */
+    void RemoveStaged(const setEntries& stage, bool updateDescendants);
+    /** Remove one entry from the indexes; its links must already have been updated */
+    void removeUnchecked(txiter entry);
+
+public:
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -119,7 +387,20 @@ public:
     void check(const CCoinsViewCache* pcoins) const;
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
+    /**
+     * Add an entry whose in-mempool ancestors were already found with
+     * CalculateMemPoolAncestors, as AcceptToMemoryPool does to enforce
+     * its limits. The other overload finds them itself, without limits.
+     */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    /**
+     * After the transactions of a disconnected block were added back, in
+     * block order, link them to the children they already have in the pool
+     * and update the statistics on both sides. Descendant limits are not
+     * enforced here.
+     */
+    void UpdateTransactionsFromBlock(const std::vector<uint256>& vHashesToUpdate);
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
@@ -135,6 +416,33 @@ public:
     void ApplyDeltas(const uint256 hash, double& dPriorityDelta, CAmount& nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * Find all in-mempool ancestors of entry, failing with errString when
+     * they, or the descendants of any of them, would exceed the limits.
+     * With fSearchForParents the parents are looked up from the inputs of
+     * entry, which need not be in the pool; otherwise entry must be in it.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const;
+
+    /** Add entry and all of its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * The minimum fee rate to get into the pool, which may itself not be
+     * enough to get in when the pool is full. sizelimit is -maxmempool in
+     * bytes and sets how fast the minimum decays.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /** Remove transactions, lowest descendant score first, until the pool uses no more than sizelimit bytes */
+    void TrimToSize(size_t sizelimit);
+
+    /** Remove transactions that entered before time, and their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+
     unsigned long size()
     {
         LOCK(cs);
@@ -154,6 +462,12 @@ public:
 
     bool lookup(uint256 hash, CTransaction& result) const;
 
+    size_t DynamicMemoryUsage() const;
+
+    /** Whether mempool.dat has been loaded, so that dumping the pool will not lose transactions */
+    bool IsLoaded() const;
+    void SetIsLoaded(bool loaded);
+
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
 
@@ -409,6 +409,7 @@ bool CWallet::IsSpent(const uint256& hash, unsigned int n) const
 void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
 {
     mapTxSpends.insert(make_pair(outpoint, wtxid));
+    EraseFromStakeIndex(outpoint);
 
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
@@ -427,6 +428,61 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+/** Depth a wallet transaction needs before its outputs may be staked */
+static int GetStakeDepthRequired(const CWalletTx& wtx)
+{
+    if (wtx.IsCoinBase() || wtx.IsCoinStake())
+        return std::max(Params().COINBASE_MATURITY() + 1, wtx.IsCoinStake() ? 0 : 10);
+    return 10;
+}
+
+/**
+ * (Re)index the outputs of wtx that could be staked. With fCheckConflicts the
+ * caller holds cs_main and outputs whose spends turned out conflicted are
+ * brought back; otherwise any recorded spend removes the output.
+ */
+void CWallet::UpdateStakeIndex(const CWalletTx& wtx, bool fCheckConflicts)
+{
+    AssertLockHeld(cs_wallet);
+    const uint256& hash = wtx.GetHash();
+
+    int nHeightMature = -1;
+    if (wtx.hashBlock != 0) {
+        BlockMap::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi != mapBlockIndex.end())
+            nHeightMature = mi->second->nHeight + GetStakeDepthRequired(wtx) - 1;
+    }
+
+    for (unsigned int i = 0; i < wtx.vout.size(); i++) {
+        COutPoint outpoint(hash, i);
+        bool fSpent = fCheckConflicts ? IsSpent(hash, i) : mapTxSpends.count(outpoint) > 0;
+        if (nHeightMature < 0 || fSpent || wtx.vout[i].nValue <= 0 || IsMine(wtx.vout[i]) == ISMINE_NO) {
+            EraseFromStakeIndex(outpoint);
+            continue;
+        }
+
+        std::map<COutPoint, int>::iterator it = mapStakeIndexHeight.find(outpoint);
+        if (it != mapStakeIndexHeight.end()) {
+            if (it->second == nHeightMature)
+                continue;
+            setStakeIndex.erase(make_pair(it->second, outpoint));
+            it->second = nHeightMature;
+        } else {
+            mapStakeIndexHeight.insert(make_pair(outpoint, nHeightMature));
+        }
+        setStakeIndex.insert(make_pair(nHeightMature, outpoint));
+    }
+}
+
+void CWallet::EraseFromStakeIndex(const COutPoint& outpoint)
+{
+    std::map<COutPoint, int>::iterator it = mapStakeIndexHeight.find(outpoint);
+    if (it == mapStakeIndexHeight.end())
+        return;
+    setStakeIndex.erase(make_pair(it->second, outpoint));
+    mapStakeIndexHeight.erase(it);
+}
+
 bool CWallet::GetMasternodeVinAndKeys(CTxIn& txinRet, CPubKey& pubKeyRet, CKey& keyRet, std::string strTxHash, std::string strOutputIndex)
 {
     // wait for reindex and/or import to finish
@@ -633,6 +689,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        UpdateStakeIndex(mapWallet[hash]);
     } else {
         LOCK(cs_wallet);
         // Inserts only if not already there, returns tx inserted or tx found
@@ -703,6 +760,9 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
             }
         }
 
+        if (fInsertedNew || fUpdated)
+            UpdateStakeIndex(wtx);
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -760,8 +820,10 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // available of the outputs it spends. So force those to be
     // recomputed, also:
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        if (mapWallet.count(txin.prevout.hash))
+        if (mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            UpdateStakeIndex(mapWallet[txin.prevout.hash], true);
+        }
     }
 }
 
@@ -771,8 +833,13 @@ void CWallet::EraseFromWallet(const uint256& hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        std::map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            for (unsigned int i = 0; i < it->second.vout.size(); i++)
+                EraseFromStakeIndex(COutPoint(hash, i));
+            mapWallet.erase(it);
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -1303,28 +1370,39 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*, un
     }
 }
 
-bool CWallet::SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const
+bool CWallet::SelectStakeCoins(std::vector<std::pair<const CWalletTx*, unsigned int> >& vCoins, int64_t nTargetAmount) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
+    LOCK2(cs_main, cs_wallet);
     int64_t nAmountSelected = 0;
 
-    BOOST_FOREACH (const COutput& out, vCoins) {
+    // Only outputs that already reached stake depth on the current tip can qualify
+    StakeIndex::const_iterator itEnd = setStakeIndex.upper_bound(make_pair(chainActive.Height(), COutPoint(~uint256(0), (uint32_t)-1)));
+    for (StakeIndex::const_iterator it = setStakeIndex.begin(); it != itEnd; ++it) {
+        const COutPoint& outpoint = it->second;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(outpoint.hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &mi->second;
+        CAmount nValue = pcoin->vout[outpoint.n].nValue;
+
         //make sure not to outrun target amount
-        if (nAmountSelected + out.tx->vout[out.i].nValue > nTargetAmount)
+        if (nAmountSelected + nValue > nTargetAmount)
             continue;
 
         //check for min age
-        if (GetTime() - out.tx->GetTxTime() < nStakeMinAge)
+        if (GetTime() - pcoin->GetTxTime() < nStakeMinAge)
             continue;
 
-        //check that it is matured
-        if (out.nDepth < (out.tx->IsCoinStake() ? Params().COINBASE_MATURITY() : 10))
+        //check that it is matured; the index height goes stale after a reorg
+        if (pcoin->GetDepthInMainChain(false) < GetStakeDepthRequired(*pcoin))
+            continue;
+
+        if (!CheckFinalTx(*pcoin) || IsSpent(outpoint.hash, outpoint.n) || IsLockedCoin(outpoint.hash, outpoint.n))
             continue;
 
         //add to our stake set
-        setCoins.insert(make_pair(out.tx, out.i));
-        nAmountSelected += out.tx->vout[out.i].nValue;
+        vCoins.push_back(make_pair(pcoin, outpoint.n));
+        nAmountSelected += nValue;
     }
     return true;
 }
@@ -1337,15 +1415,9 @@ bool CWallet::MintableCoins()
     if (nBalance <= nReserveBalance)
         return false;
 
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true);
-
-    BOOST_FOREACH (const COutput& out, vCoins) {
-        if (GetTime() - out.tx->GetTxTime() > nStakeMinAge)
-            return true;
-    }
-
-    return false;
+    vector<pair<const CWalletTx*, unsigned int> > vCoins;
+    SelectStakeCoins(vCoins, nBalance - nReserveBalance);
+    return !vCoins.empty();
 }
 
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
@@ -1776,19 +1848,47 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, CBlock* pblock, unsigne
     if (nBalance <= nReserveBalance)
         return false;
 
-    // presstab HyperStake - Initialize as static and don't update the set on every run of CreateCoinStake() in order to lighten resource use
-    static std::set<pair<const CWalletTx*, unsigned int> > setStakeCoins;
-    static int nLastStakeSetUpdate = 0;
+    // Stake candidates come from the wallet's stake index and are always current
+    vector<pair<const CWalletTx*, unsigned int> > vSelectedCoins;
+    if (!SelectStakeCoins(vSelectedCoins, nBalance - nReserveBalance))
+        return false;
 
-    if (GetTime() - nLastStakeSetUpdate > nStakeSetUpdateTime) {
-        setStakeCoins.clear();
-        if (!SelectStakeCoins(setStakeCoins, nBalance - nReserveBalance))
-            return false;
+    // The kernel search table is only rebuilt when the candidate set changes,
+    // so resolved stake modifiers survive from one minter tick to the next
+    static CStakeKernelSearch stakeSearch;
+    static std::vector<COutPoint> vStakeSearchPrevouts;
+
+    vector<pair<const CWalletTx*, unsigned int> > vStakeCoins;
+    std::vector<COutPoint> vPrevouts;
+    std::vector<CBlockIndex*> vpindexFrom;
+    vStakeCoins.reserve(vSelectedCoins.size());
+    vPrevouts.reserve(vSelectedCoins.size());
+    vpindexFrom.reserve(vSelectedCoins.size());
+    {
+        LOCK(cs_main);
+        for (unsigned int i = 0; i < vSelectedCoins.size(); i++) {
+            // Skip a coin whose block is not known here, rather than adding
+            // an empty index entry; the search table has to stay aligned
+            // with vStakeCoins
+            BlockMap::iterator mi = mapBlockIndex.find(vSelectedCoins[i].first->hashBlock);
+            if (mi == mapBlockIndex.end() || !mi->second)
+                continue;
+            vStakeCoins.push_back(vSelectedCoins[i]);
+            vPrevouts.push_back(COutPoint(vSelectedCoins[i].first->GetHash(), vSelectedCoins[i].second));
+            vpindexFrom.push_back(mi->second);
+        }
+    }
 
-        nLastStakeSetUpdate = GetTime();
+    if (vPrevouts != vStakeSearchPrevouts) {
+        LOCK(cs_main);
+        stakeSearch.Clear();
+        vStakeSearchPrevouts.clear();
+        for (unsigned int i = 0; i < vStakeCoins.size(); i++)
+            stakeSearch.Add(vPrevouts[i], vStakeCoins[i].first->vout[vStakeCoins[i].second].nValue, vpindexFrom[i]);
+        vStakeSearchPrevouts = vPrevouts;
     }
 
-    if (setStakeCoins.empty())
+    if (stakeSearch.empty())
         return false;
 
     vector<const CWalletTx*> vwtxPrev;
@@ -1800,28 +1900,20 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, CBlock* pblock, unsigne
     if (GetAdjustedTime() <= chainActive.Tip()->nTime)
         MilliSleep(10000);
 
-    BOOST_FOREACH (PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setStakeCoins) {
-        //make sure that enough time has elapsed between
-        CBlockIndex* pindex = NULL;
-        BlockMap::iterator it = mapBlockIndex.find(pcoin.first->hashBlock);
-        if (it != mapBlockIndex.end())
-            pindex = it->second;
-        else {
-            if (fDebug)
-                LogPrintf("CreateCoinStake() failed to find block index \n");
-            continue;
-        }
-
-        // Read block header
-        CBlockHeader block = pindex->GetBlockHeader();
+    {
+        LOCK(cs_main);
+        stakeSearch.Prepare(nBits);
+    }
 
+    unsigned int nSearchTime = GetAdjustedTime();
+    uint256 hashProofOfStake = 0;
+    for (size_t nIndex = 0; nIndex < vStakeCoins.size(); nIndex++) {
         bool fKernelFound = false;
-        uint256 hashProofOfStake = 0;
-        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-        nTxNewTime = GetAdjustedTime();
 
-        //iterates each utxo inside of CheckStakeKernelHash()
-        if (CheckStakeKernelHash(nBits, block, *pcoin.first, prevoutStake, nTxNewTime, nHashDrift, false, hashProofOfStake, true)) {
+        //hashes every remaining utxo over the drift window, stopping at the first kernel
+        if (stakeSearch.Search(nSearchTime, nHashDrift, nIndex, nTxNewTime, hashProofOfStake, nStakeThreads)) {
+            PAIRTYPE(const CWalletTx*, unsigned int) pcoin = vStakeCoins[nIndex];
+
             //Double check that this will pass time requirements
             if (nTxNewTime <= chainActive.Tip()->GetMedianTimePast()) {
                 LogPrintf("CreateCoinStake() : kernel found, but it is too far in the past \n");
@@ -1931,7 +2023,6 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, CBlock* pblock, unsigne
     }
 
     // Successfully generated coinstake
-    nLastStakeSetUpdate = 0; //this will trigger stake set to repopulate next round
     return true;
 }
 
@@ -159,9 +159,21 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Outputs that can become stake inputs, keyed by the chain height at which
+     * they reach stake depth. Maintained from AddToWallet, AddToSpends and
+     * SyncTransaction so that staking never has to scan all of mapWallet.
+     */
+    typedef std::set<std::pair<int, COutPoint> > StakeIndex;
+    StakeIndex setStakeIndex;
+    std::map<COutPoint, int> mapStakeIndexHeight;
+
+    void UpdateStakeIndex(const CWalletTx& wtx, bool fCheckConflicts = false);
+    void EraseFromStakeIndex(const COutPoint& outpoint);
+
 public:
     bool MintableCoins();
-    bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, int64_t nTargetAmount) const;
+    bool SelectStakeCoins(std::vector<std::pair<const CWalletTx*, unsigned int> >& vCoins, int64_t nTargetAmount) const;
     int CountInputsWithAmount(int64_t nInputAmount);
 
     /*
@@ -188,7 +200,6 @@ public:
     unsigned int nHashDrift;
     unsigned int nHashInterval;
     uint64_t nStakeSplitThreshold;
-    int nStakeSetUpdateTime;
 
     //MultiSend
     std::vector<std::pair<std::string, int> > vMultiSend;
@@ -239,7 +250,6 @@ public:
         nHashDrift = 45;
         nStakeSplitThreshold = 30;
         nHashInterval = 22;
-        nStakeSetUpdateTime = 300; // 5 minutes
 
         //MultiSend
         vMultiSend.clear();